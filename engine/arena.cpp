@@ -0,0 +1,217 @@
+#include "engine/arena.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/mempolicy.h>
+#endif
+
+namespace mc {
+
+namespace {
+
+HugePages initial_huge_pages() {
+  HugePages mode;
+  const char* env = std::getenv("MC_HUGE_PAGES");
+  if (env && huge_pages_from_string(env, mode)) {
+    return mode;
+  }
+  return HugePages::Transparent;
+}
+
+std::atomic<HugePages>& huge_pages_mode() {
+  static std::atomic<HugePages> mode{initial_huge_pages()};
+  return mode;
+}
+
+// nodes an mbind(2) mask can name
+const int MAX_NODES = 1024;
+
+// number after key on the first line of a /proc file that starts with it, or 0
+uint64_t proc_value(const char* path, std::string const& key) {
+  std::ifstream file(path);
+  std::string line;
+  while (std::getline(file, line)) {
+    if (line.compare(0, key.size(), key) == 0) {
+      return std::strtoull(line.c_str() + key.size(), nullptr, 10);
+    }
+  }
+  return 0;
+}
+
+}
+
+const char* huge_pages_name(HugePages mode) {
+  switch (mode) {
+    case HugePages::Off: return "off";
+    case HugePages::Explicit: return "hugetlb";
+    default: return "thp";
+  }
+}
+
+bool huge_pages_from_string(std::string const& name, HugePages& mode) {
+  const HugePages all[] = { HugePages::Off, HugePages::Transparent, HugePages::Explicit };
+  for (HugePages candidate : all) {
+    if (name == huge_pages_name(candidate)) {
+      mode = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+HugePages huge_pages() {
+  return huge_pages_mode().load(std::memory_order_relaxed);
+}
+
+void set_huge_pages(HugePages mode) {
+  huge_pages_mode().store(mode, std::memory_order_relaxed);
+}
+
+MemoryStats memory_stats() {
+  MemoryStats stats;
+  rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    stats.minor_faults = static_cast<uint64_t>(usage.ru_minflt);
+    stats.major_faults = static_cast<uint64_t>(usage.ru_majflt);
+  }
+  stats.anon_huge_bytes = proc_value("/proc/self/smaps_rollup", "AnonHugePages:") * 1024;
+  stats.numa_pages_migrated = proc_value("/proc/vmstat", "numa_pages_migrated ");
+  return stats;
+}
+
+Arena::Arena(size_t block_size) : _block_size(block_size) {}
+
+Arena::Arena(Arena&& other) noexcept
+  : _blocks(std::move(other._blocks)), _block_size(other._block_size), _current(other._current), _offset(other._offset),
+    _used(other._used), _peak(other._peak), _node(other._node), _hugetlb_bytes(other._hugetlb_bytes) {
+  other._blocks.clear();
+  other.reset();
+}
+
+Arena::~Arena() {
+  for (Block const& block : _blocks) {
+    munmap(block.data, block.size);
+  }
+}
+
+// Maps at least size bytes, rounded up to whole huge pages. Explicit huge pages come
+// aligned; otherwise the mapping is over-allocated by one huge page and trimmed, so the
+// block starts on a huge page boundary and THP can back all of it. The block is bound to
+// the arena's node before anything touches it.
+void Arena::map_block(size_t size) {
+  size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+  HugePages mode = huge_pages();
+#if defined(MAP_HUGETLB)
+  if (mode == HugePages::Explicit) {
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+#if defined(MAP_HUGE_SHIFT)
+    flags |= 21 << MAP_HUGE_SHIFT;  // 2MB pages whatever the default huge page size
+#endif
+    void* region = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (region != MAP_FAILED) {
+      _blocks.push_back(Block{static_cast<char*>(region), size});
+      _hugetlb_bytes += size;
+      bind_block(_blocks.back(), 0);
+      return;
+    }
+  }
+#endif
+  size_t mapped = size + HUGE_PAGE_SIZE;
+  void* region = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (region == MAP_FAILED) {
+    throw std::bad_alloc();
+  }
+  char* start = static_cast<char*>(region);
+  char* aligned = start + (HUGE_PAGE_SIZE - reinterpret_cast<uintptr_t>(start) % HUGE_PAGE_SIZE) % HUGE_PAGE_SIZE;
+  if (aligned > start) {
+    munmap(start, static_cast<size_t>(aligned - start));
+  }
+  size_t tail = mapped - static_cast<size_t>(aligned - start) - size;
+  if (tail > 0) {
+    munmap(aligned + size, tail);
+  }
+  _blocks.push_back(Block{aligned, size});
+  bind_block(_blocks.back(), 0);
+#ifdef MADV_HUGEPAGE
+  if (mode != HugePages::Off) {
+    madvise(aligned, size, MADV_HUGEPAGE);
+  }
+#endif
+}
+
+// Applies the arena's node to a block: preferred, so a full node falls back to another
+// rather than failing the fault, or the default policy when unbound.
+bool Arena::bind_block(Block const& block, unsigned flags) const {
+#if defined(__linux__) && defined(SYS_mbind)
+  unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))] = {};
+  int mode = MPOL_DEFAULT;
+  if (_node >= 0) {
+    mask[static_cast<size_t>(_node) / (8 * sizeof(unsigned long))] = 1ul << (static_cast<size_t>(_node) % (8 * sizeof(unsigned long)));
+    mode = MPOL_PREFERRED;
+  }
+  return syscall(SYS_mbind, block.data, block.size, mode, _node >= 0 ? mask : nullptr, MAX_NODES + 1, flags) == 0;
+#else
+  (void)block;
+  (void)flags;
+  return false;
+#endif
+}
+
+bool Arena::bind(int node) {
+  if (node >= MAX_NODES) {
+    return false;
+  }
+  _node = node;
+  bool ok = true;
+  for (Block const& block : _blocks) {
+#if defined(MPOL_MF_MOVE)
+    ok = bind_block(block, MPOL_MF_MOVE) && ok;
+#else
+    ok = bind_block(block, 0) && ok;
+#endif
+  }
+  return ok;
+}
+
+void* Arena::allocate(size_t bytes, size_t alignment) {
+  for (;;) {
+    if (_current < _blocks.size()) {
+      Block const& block = _blocks[_current];
+      size_t start = (_offset + alignment - 1) & ~(alignment - 1);
+      if (start + bytes <= block.size) {
+        _used += start + bytes - _offset;
+        _peak = std::max(_peak, _used);
+        _offset = start + bytes;
+        return block.data + start;
+      }
+      // blocks too small for this request are skipped until the next reset
+      if (_current + 1 < _blocks.size()) {
+        _current++;
+        _offset = 0;
+        continue;
+      }
+    }
+    map_block(std::max(_block_size, bytes + alignment));
+    _current = _blocks.size() - 1;
+    _offset = 0;
+  }
+}
+
+size_t Arena::capacity() const {
+  size_t total = 0;
+  for (Block const& block : _blocks) {
+    total += block.size;
+  }
+  return total;
+}
+
+}
@@ -0,0 +1,120 @@
+#ifndef MC_ARENA_H
+#define MC_ARENA_H
+
+// Monotonic scratch memory for pricing jobs.
+//
+// Each worker owns an arena and every buffer a job needs (chunk normals, evolved prices,
+// per-contract parameters and sums) is carved out of it by bumping an offset. Nothing is
+// freed on its own: reset() at the start of the next job makes the whole arena reusable
+// at once. Blocks are mapped directly from the kernel, 2MB-aligned and backed by huge pages
+// (see HugePages), and are kept until the arena is destroyed, so once a worker has seen its
+// largest job the pricing loop no longer touches the heap or the page tables.
+//
+// On a machine with more than one NUMA node an arena can be bound to the node of the CPU
+// its worker is pinned to (EngineContext::pin_workers), so its pages are allocated, and
+// stay, next to the core that fills them. Binding uses mbind(2) directly, without libnuma;
+// kernels without NUMA support simply leave placement to first touch.
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace mc {
+
+// How arena blocks are backed.
+enum class HugePages : uint8_t {
+  Off,          // normal pages
+  Transparent,  // madvise(MADV_HUGEPAGE): THP if the kernel has it enabled, the default
+  Explicit      // MAP_HUGETLB from the hugetlbfs pool, THP where the pool is empty
+};
+
+// "off", "thp" or "hugetlb"
+const char* huge_pages_name(HugePages mode);
+bool huge_pages_from_string(std::string const& name, HugePages& mode);
+
+// The backing of blocks mapped from now on: MC_HUGE_PAGES if it names a mode,
+// Transparent otherwise. set_huge_pages() changes it for arenas yet to map a block.
+HugePages huge_pages();
+void set_huge_pages(HugePages mode);
+
+// Memory counters of the process, for run summaries; 0 where the kernel does not report one.
+struct MemoryStats {
+  uint64_t minor_faults = 0;
+  uint64_t major_faults = 0;
+  uint64_t anon_huge_bytes = 0;     // anonymous memory on transparent huge pages
+  uint64_t numa_pages_migrated = 0; // pages moved between nodes, system-wide
+};
+
+MemoryStats memory_stats();
+
+class Arena {
+  private:
+    struct Block {
+      char* data;
+      size_t size;
+    };
+
+    std::vector<Block> _blocks;
+    size_t _block_size;
+    size_t _current = 0;  // block allocations come from
+    size_t _offset = 0;   // bytes used in the current block
+    size_t _used = 0;     // bytes handed out since reset(), padding included
+    size_t _peak = 0;
+    int _node = -1;             // NUMA node blocks are bound to, -1 for none
+    size_t _hugetlb_bytes = 0;  // bytes of blocks on explicit huge pages
+
+    void map_block(size_t size);
+    bool bind_block(Block const& block, unsigned flags) const;
+
+  public:
+    static const size_t HUGE_PAGE_SIZE = 2u << 20;
+    static const size_t CACHE_LINE = 64;
+
+    explicit Arena(size_t block_size = HUGE_PAGE_SIZE);
+    ~Arena();
+
+    Arena(Arena&& other) noexcept;
+    Arena(Arena const&) = delete;
+    Arena& operator=(Arena const&) = delete;
+    Arena& operator=(Arena&&) = delete;
+
+    // bytes aligned to alignment, a power of two; throws std::bad_alloc if no memory can
+    // be mapped
+    void* allocate(size_t bytes, size_t alignment = CACHE_LINE);
+
+    // count uninitialised Ts, cache-line aligned
+    template <class T>
+    T* allocate(size_t count) {
+      return static_cast<T*>(allocate(count * sizeof(T), alignof(T) > CACHE_LINE ? alignof(T) : CACHE_LINE));
+    }
+
+    // Starts the next job: everything allocated so far may be overwritten.
+    void reset() {
+      _current = 0;
+      _offset = 0;
+      _used = 0;
+    }
+
+    // bytes mapped, and the most any job has used
+    size_t capacity() const;
+    size_t peak() const {
+      return _peak;
+    }
+
+    // Binds the arena to a NUMA node, -1 to unbind: blocks mapped from now on are
+    // allocated there, and the pages of existing blocks are moved. False if the kernel
+    // refused, in which case pages stay where first touch put them.
+    bool bind(int node);
+    int node() const {
+      return _node;
+    }
+
+    size_t hugetlb_bytes() const {
+      return _hugetlb_bytes;
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,348 @@
+#ifndef MC_ASYNC_LOG_H
+#define MC_ASYNC_LOG_H
+
+// Asynchronous structured logger.
+//
+// Producers copy a fixed-size record (level, event name, up to LOG_MAX_FIELDS typed fields
+// and an optional short text) into a bounded lock-free ring buffer and return; nothing is
+// formatted or written on the calling thread. A single background thread drains the ring,
+// renders each record as one JSON line and writes them to stderr in batches. When the ring
+// is full records are dropped and counted rather than blocking the producer, and the writer
+// follows its next batch with a "log_dropped" warning giving how many were lost since the last.
+//
+// Event and field names are stored as pointers and must be string literals.
+//
+// The level comes from LOG_LEVEL (trace, debug, info, warn, error, fatal, off; default info)
+// and can be changed at any time with set_level().
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+namespace mc {
+
+enum class LogLevel : uint8_t { Trace, Debug, Info, Warn, Error, Fatal, Off };
+
+static const size_t LOG_MAX_FIELDS = 10;
+static const size_t LOG_TEXT_SIZE = 240;
+static const size_t LOG_RING_SIZE = 4096;  // records, power of two
+
+struct LogField {
+  enum Type : uint8_t { INT, FLOAT, STRING };
+
+  const char* name;
+  Type type;
+  union {
+    int64_t i;
+    double d;
+    const char* s;  // literal
+  };
+
+  LogField(const char* field_name, int value) : name(field_name), type(INT), i(value) {}
+  LogField(const char* field_name, long value) : name(field_name), type(INT), i(value) {}
+  LogField(const char* field_name, long long value) : name(field_name), type(INT), i(value) {}
+  LogField(const char* field_name, unsigned value) : name(field_name), type(INT), i(value) {}
+  LogField(const char* field_name, unsigned long value) : name(field_name), type(INT), i(static_cast<int64_t>(value)) {}
+  LogField(const char* field_name, unsigned long long value) : name(field_name), type(INT), i(static_cast<int64_t>(value)) {}
+  LogField(const char* field_name, double value) : name(field_name), type(FLOAT), d(value) {}
+  LogField(const char* field_name, const char* literal) : name(field_name), type(STRING), s(literal) {}
+  LogField() : name(nullptr), type(INT), i(0) {}
+};
+
+struct LogRecord {
+  int64_t time_us;
+  const char* event;
+  uint32_t thread;
+  LogLevel level;
+  uint8_t field_count;
+  uint16_t text_size;
+  LogField fields[LOG_MAX_FIELDS];
+  char text[LOG_TEXT_SIZE];
+};
+
+inline const char* log_level_name(LogLevel level) {
+  static const char* const names[] = { "trace", "debug", "info", "warn", "error", "fatal", "off" };
+  return names[static_cast<int>(level)];
+}
+
+inline LogLevel log_level_from_string(std::string const& name, LogLevel fallback) {
+  for (int l = 0; l <= static_cast<int>(LogLevel::Off); l++) {
+    if (name == log_level_name(static_cast<LogLevel>(l))) {
+      return static_cast<LogLevel>(l);
+    }
+  }
+  return fallback;
+}
+
+class AsyncLogger {
+  private:
+    struct Cell {
+      std::atomic<size_t> sequence;
+      LogRecord record;
+    };
+
+    std::unique_ptr<Cell[]> _cells;
+    std::atomic<size_t> _head{0};   // next slot producers claim
+    size_t _tail = 0;               // next slot the writer reads, writer thread only
+    std::atomic<size_t> _written{0};
+    std::atomic<uint64_t> _dropped{0};
+    uint64_t _reported_dropped = 0;  // writer thread only
+    std::atomic<int> _level;
+    std::atomic<uint32_t> _next_thread{0};
+
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::condition_variable _drained;
+    bool _stop = false;
+    std::thread _writer;
+
+    uint32_t thread_index() {
+      static thread_local uint32_t index = _next_thread.fetch_add(1, std::memory_order_relaxed);
+      return index;
+    }
+
+    // Claims a slot; returns nullptr when the ring is full.
+    Cell* claim(size_t& pos) {
+      pos = _head.load(std::memory_order_relaxed);
+      for (;;) {
+        Cell& cell = _cells[pos & (LOG_RING_SIZE - 1)];
+        size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+        if (diff == 0) {
+          if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+            return &cell;
+          }
+        } else if (diff < 0) {
+          return nullptr;
+        } else {
+          pos = _head.load(std::memory_order_relaxed);
+        }
+      }
+    }
+
+    static void append_escaped(std::string& out, const char* text, size_t size) {
+      for (size_t i = 0; i < size; i++) {
+        char c = text[i];
+        switch (c) {
+          case '"': out += "\\\""; break;
+          case '\\': out += "\\\\"; break;
+          case '\n': out += "\\n"; break;
+          case '\r': out += "\\r"; break;
+          case '\t': out += "\\t"; break;
+          default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+              char buf[8];
+              snprintf(buf, sizeof(buf), "\\u%04x", c);
+              out += buf;
+            } else {
+              out += c;
+            }
+        }
+      }
+    }
+
+    static void format(std::string& out, LogRecord const& record) {
+      char buf[64];
+      snprintf(buf, sizeof(buf), "{\"ts_us\":%lld,\"level\":\"", static_cast<long long>(record.time_us));
+      out += buf;
+      out += log_level_name(record.level);
+      snprintf(buf, sizeof(buf), "\",\"thread\":%u,\"event\":\"", record.thread);
+      out += buf;
+      append_escaped(out, record.event, strlen(record.event));
+      out += '"';
+      for (size_t f = 0; f < record.field_count; f++) {
+        LogField const& field = record.fields[f];
+        out += ",\"";
+        out += field.name;
+        out += "\":";
+        switch (field.type) {
+          case LogField::INT:
+            snprintf(buf, sizeof(buf), "%lld", static_cast<long long>(field.i));
+            out += buf;
+            break;
+          case LogField::FLOAT:
+            snprintf(buf, sizeof(buf), "%.17g", field.d);
+            out += (strchr(buf, 'n') || strchr(buf, 'i')) ? "null" : buf;  // nan, inf
+            break;
+          case LogField::STRING:
+            out += '"';
+            append_escaped(out, field.s, strlen(field.s));
+            out += '"';
+            break;
+        }
+      }
+      if (record.text_size > 0) {
+        out += ",\"msg\":\"";
+        append_escaped(out, record.text, record.text_size);
+        out += '"';
+      }
+      out += "}\n";
+    }
+
+    void writer_loop() {
+      std::string out;
+      for (;;) {
+        size_t drained = 0;
+        for (;;) {
+          Cell& cell = _cells[_tail & (LOG_RING_SIZE - 1)];
+          if (cell.sequence.load(std::memory_order_acquire) != _tail + 1) {
+            break;
+          }
+          format(out, cell.record);
+          cell.sequence.store(_tail + LOG_RING_SIZE, std::memory_order_release);
+          _tail++;
+          drained++;
+        }
+        // written straight into the batch: the ring the report would go through is what overflowed
+        uint64_t dropped = _dropped.load(std::memory_order_relaxed);
+        if (dropped != _reported_dropped) {
+          if (level() != LogLevel::Off) {
+            LogRecord record;
+            record.time_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+            record.event = "log_dropped";
+            record.thread = thread_index();
+            record.level = LogLevel::Warn;
+            record.field_count = 2;
+            record.fields[0] = LogField("dropped", static_cast<unsigned long long>(dropped - _reported_dropped));
+            record.fields[1] = LogField("total", static_cast<unsigned long long>(dropped));
+            record.text_size = 0;
+            format(out, record);
+          }
+          _reported_dropped = dropped;
+        }
+        if (!out.empty()) {
+          size_t done = 0;
+          while (done < out.size()) {
+            ssize_t n = ::write(STDERR_FILENO, out.data() + done, out.size() - done);
+            if (n <= 0) {
+              break;
+            }
+            done += static_cast<size_t>(n);
+          }
+          out.clear();
+        }
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        _written.store(_tail, std::memory_order_release);
+        _drained.notify_all();
+        if (drained == 0) {
+          if (_stop) {
+            return;
+          }
+          _wake.wait_for(lock, std::chrono::milliseconds(2));
+        }
+      }
+    }
+
+    AsyncLogger() : _cells(new Cell[LOG_RING_SIZE]) {
+      for (size_t i = 0; i < LOG_RING_SIZE; i++) {
+        _cells[i].sequence.store(i, std::memory_order_relaxed);
+      }
+      const char* level = getenv("LOG_LEVEL");
+      _level = static_cast<int>(log_level_from_string(level ? level : "", LogLevel::Info));
+      _writer = std::thread(&AsyncLogger::writer_loop, this);
+    }
+
+  public:
+    static AsyncLogger& instance() {
+      static AsyncLogger logger;
+      return logger;
+    }
+
+    ~AsyncLogger() {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+      }
+      _wake.notify_one();
+      _writer.join();
+    }
+
+    AsyncLogger(AsyncLogger const&) = delete;
+    AsyncLogger& operator=(AsyncLogger const&) = delete;
+
+    void set_level(LogLevel level) {
+      _level.store(static_cast<int>(level), std::memory_order_relaxed);
+    }
+
+    LogLevel level() const {
+      return static_cast<LogLevel>(_level.load(std::memory_order_relaxed));
+    }
+
+    bool enabled(LogLevel level) const {
+      return level != LogLevel::Off && static_cast<int>(level) >= _level.load(std::memory_order_relaxed);
+    }
+
+    // Enqueues one record; text, if any, is copied and truncated to LOG_TEXT_SIZE.
+    void log(LogLevel level, const char* event, const LogField* fields, size_t field_count, const char* text, size_t text_size) {
+      if (!enabled(level)) {
+        return;
+      }
+      size_t pos;
+      Cell* cell = claim(pos);
+      if (!cell) {
+        _dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+      LogRecord& record = cell->record;
+      record.time_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+      record.event = event;
+      record.thread = thread_index();
+      record.level = level;
+      record.field_count = static_cast<uint8_t>(std::min(field_count, LOG_MAX_FIELDS));
+      std::copy(fields, fields + record.field_count, record.fields);
+      record.text_size = static_cast<uint16_t>(std::min(text_size, LOG_TEXT_SIZE));
+      if (record.text_size > 0) {
+        memcpy(record.text, text, record.text_size);
+      }
+      cell->sequence.store(pos + 1, std::memory_order_release);
+
+      // wake the writer early during bursts instead of waiting out its poll interval
+      if ((pos & (LOG_RING_SIZE / 4 - 1)) == 0) {
+        _wake.notify_one();
+      }
+    }
+
+    void log(LogLevel level, const char* event, std::initializer_list<LogField> fields) {
+      log(level, event, fields.begin(), fields.size(), nullptr, 0);
+    }
+
+    void log(LogLevel level, const char* event, std::initializer_list<LogField> fields, std::string const& text) {
+      log(level, event, fields.begin(), fields.size(), text.data(), text.size());
+    }
+
+    // Blocks until every record enqueued before the call has been written.
+    void flush() {
+      size_t target = _head.load(std::memory_order_acquire);
+      std::unique_lock<std::mutex> lock(_mutex);
+      _wake.notify_one();
+      _drained.wait_for(lock, std::chrono::seconds(1), [&] { return _written.load(std::memory_order_acquire) >= target; });
+    }
+
+    uint64_t dropped() const {
+      return _dropped.load(std::memory_order_relaxed);
+    }
+};
+
+inline void log_event(LogLevel level, const char* event, std::initializer_list<LogField> fields = {}) {
+  AsyncLogger::instance().log(level, event, fields);
+}
+
+inline void log_event(LogLevel level, const char* event, std::initializer_list<LogField> fields, std::string const& text) {
+  AsyncLogger::instance().log(level, event, fields, text);
+}
+
+}
+
+#endif
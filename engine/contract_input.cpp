@@ -0,0 +1,348 @@
+#include "engine/contract_input.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace mc {
+
+namespace {
+
+// largest mantissa and powers of ten that are exact in a double, so one multiplication or
+// division of the two is correctly rounded
+const uint64_t EXACT_MANTISSA = 1ULL << 53;
+const double EXACT_POWERS[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+void store_le(char* out, uint64_t value) {
+  for (int i = 0; i < 8; i++) {
+    out[i] = static_cast<char>((value >> (8 * i)) & 0xff);
+  }
+}
+
+uint64_t load_le(const char* in) {
+  uint64_t value = 0;
+  for (int i = 0; i < 8; i++) {
+    value |= static_cast<uint64_t>(static_cast<unsigned char>(in[i])) << (8 * i);
+  }
+  return value;
+}
+
+// a path count is a whole number: "1000.7" is rejected rather than priced as 1000
+bool valid_contract(double num_sims, double S, double K, double v, double T) {
+  return num_sims >= 1 && num_sims <= 2147483647.0 && num_sims == std::floor(num_sims) && S > 0 && K > 0 && v > 0 && T > 0;
+}
+
+bool is_separator(char c) {
+  return c == ',' || c == ' ' || c == '\t' || c == '\r';
+}
+
+const char* line_end(const char* pos, const char* end) {
+  const void* newline = std::memchr(pos, '\n', static_cast<size_t>(end - pos));
+  return newline ? static_cast<const char*>(newline) : end;
+}
+
+const char* next_line(const char* pos, const char* end) {
+  const char* eol = line_end(pos, end);
+  return eol < end ? eol + 1 : end;
+}
+
+}
+
+std::string contract_file_header(uint64_t count) {
+  char header[CONTRACT_HEADER_SIZE];
+  std::memcpy(header, CONTRACT_FILE_MAGIC, 4);
+  header[4] = static_cast<char>(CONTRACT_FORMAT_VERSION & 0xff);
+  header[5] = static_cast<char>(CONTRACT_FORMAT_VERSION >> 8);
+  header[6] = static_cast<char>(CONTRACT_RECORD_SIZE & 0xff);
+  header[7] = static_cast<char>(CONTRACT_RECORD_SIZE >> 8);
+  store_le(header + 8, count);
+  return std::string(header, sizeof(header));
+}
+
+void encode_contract(Contract const& contract, char* record) {
+  const double fields[5] = { contract.S, contract.K, contract.r, contract.v, contract.T };
+  store_le(record, static_cast<uint64_t>(static_cast<int64_t>(contract.num_sims)));
+  for (int i = 0; i < 5; i++) {
+    uint64_t bits;
+    std::memcpy(&bits, &fields[i], sizeof(bits));
+    store_le(record + 8 * (i + 1), bits);
+  }
+}
+
+Contract decode_contract(const char* record) {
+  double fields[5];
+  for (int i = 0; i < 5; i++) {
+    uint64_t bits = load_le(record + 8 * (i + 1));
+    std::memcpy(&fields[i], &bits, sizeof(bits));
+  }
+  int64_t num_sims = static_cast<int64_t>(load_le(record));
+  return Contract{static_cast<int>(num_sims), fields[0], fields[1], fields[2], fields[3], fields[4]};
+}
+
+// Decimal mantissa and exponent in one pass; the common short inputs ("100", "0.05") are
+// converted exactly there, anything longer goes through strtod on a stack copy.
+bool parse_decimal(const char* begin, const char* end, double& value) {
+  const char* p = begin;
+  bool negative = false;
+  if (p < end && (*p == '+' || *p == '-')) {
+    negative = *p == '-';
+    p++;
+  }
+
+  uint64_t mantissa = 0;
+  int digits = 0;
+  int exponent = 0;
+  bool any = false;
+  bool exact = true;
+  for (; p < end && *p >= '0' && *p <= '9'; p++) {
+    any = true;
+    if (digits < 19) {
+      mantissa = mantissa * 10 + static_cast<uint64_t>(*p - '0');
+      digits += mantissa != 0;
+    } else {
+      exponent++;
+      exact = exact && *p == '0';
+    }
+  }
+  if (p < end && *p == '.') {
+    for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+      any = true;
+      if (digits < 19) {
+        mantissa = mantissa * 10 + static_cast<uint64_t>(*p - '0');
+        digits += mantissa != 0;
+        exponent--;
+      } else {
+        exact = exact && *p == '0';
+      }
+    }
+  }
+  if (!any) {
+    return false;
+  }
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    p++;
+    bool negative_exponent = false;
+    if (p < end && (*p == '+' || *p == '-')) {
+      negative_exponent = *p == '-';
+      p++;
+    }
+    if (p == end) {
+      return false;
+    }
+    int e = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+      e = std::min(e * 10 + (*p - '0'), 100000);
+    }
+    exponent += negative_exponent ? -e : e;
+  }
+  if (p != end) {
+    return false;
+  }
+
+  if (exact && mantissa <= EXACT_MANTISSA && exponent >= -22 && exponent <= 22) {
+    double m = static_cast<double>(mantissa);
+    value = exponent < 0 ? m / EXACT_POWERS[-exponent] : m * EXACT_POWERS[exponent];
+  } else {
+    char copy[64];
+    size_t length = static_cast<size_t>(end - begin);
+    if (length >= sizeof(copy)) {
+      return false;
+    }
+    std::memcpy(copy, begin, length);
+    copy[length] = '\0';
+    value = std::strtod(copy, nullptr);
+    negative = false;
+  }
+  if (negative) {
+    value = -value;
+  }
+  return std::isfinite(value);
+}
+
+ContractLine parse_contract_line(const char* begin, const char* end, Contract& contract) {
+  const char* fields[6][2];
+  int count = 0;
+  const char* p = begin;
+  while (p < end && *p != '#') {
+    if (is_separator(*p)) {
+      p++;
+      continue;
+    }
+    const char* field = p;
+    while (p < end && *p != '#' && !is_separator(*p)) {
+      p++;
+    }
+    if (count == 6) {
+      return ContractLine::Invalid;
+    }
+    fields[count][0] = field;
+    fields[count][1] = p;
+    count++;
+  }
+  if (count == 0) {
+    return ContractLine::Blank;
+  }
+  if (count != 6) {
+    return ContractLine::Invalid;
+  }
+
+  double values[6];
+  for (int i = 0; i < 6; i++) {
+    if (!parse_decimal(fields[i][0], fields[i][1], values[i])) {
+      return ContractLine::Invalid;
+    }
+  }
+  if (!valid_contract(values[0], values[1], values[2], values[4], values[5])) {
+    return ContractLine::Invalid;
+  }
+  contract = Contract{static_cast<int>(values[0]), values[1], values[2], values[3], values[4], values[5]};
+  return ContractLine::Contract;
+}
+
+bool is_header_line(const char* begin, const char* end) {
+  const char* p = begin;
+  while (p < end && is_separator(*p)) {
+    p++;
+  }
+  return p < end && !((*p >= '0' && *p <= '9') || *p == '+' || *p == '-' || *p == '.' || *p == '#' || *p == '\n');
+}
+
+bool ContractCursor::next(Contract& contract) {
+  if (_binary) {
+    if (_end - _pos < static_cast<ptrdiff_t>(CONTRACT_RECORD_SIZE)) {
+      return false;
+    }
+    Contract record = decode_contract(_pos);
+    double num_sims = static_cast<double>(static_cast<int64_t>(load_le(_pos)));
+    if (!valid_contract(num_sims, record.S, record.K, record.v, record.T)) {
+      return false;
+    }
+    contract = record;
+    _pos += CONTRACT_RECORD_SIZE;
+    return true;
+  }
+
+  while (_pos < _end) {
+    const char* eol = line_end(_pos, _end);
+    switch (parse_contract_line(_pos, eol, contract)) {
+      case ContractLine::Contract:
+        _pos = eol < _end ? eol + 1 : _end;
+        return true;
+      case ContractLine::Blank:
+        _pos = eol < _end ? eol + 1 : _end;
+        break;
+      case ContractLine::Invalid:
+        return false;
+    }
+  }
+  return false;
+}
+
+size_t ContractCursor::count() const {
+  if (_binary) {
+    return static_cast<size_t>(_end - _pos) / CONTRACT_RECORD_SIZE;
+  }
+
+  size_t contracts = 0;
+  for (const char* p = _pos; p < _end; p = next_line(p, _end)) {
+    while (p < _end && is_separator(*p)) {
+      p++;
+    }
+    contracts += p < _end && *p != '\n' && *p != '#';
+  }
+  return contracts;
+}
+
+ContractFile::~ContractFile() {
+  if (_data) {
+    munmap(const_cast<char*>(_data), _size);
+  }
+}
+
+bool ContractFile::open(std::string const& path, std::string& error) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    error = "cannot open " + path + ": " + std::strerror(errno);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    error = "cannot stat " + path + ": " + std::strerror(errno);
+    close(fd);
+    return false;
+  }
+  _size = static_cast<size_t>(st.st_size);
+  if (_size > 0) {
+    void* data = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      error = "cannot map " + path + ": " + std::strerror(errno);
+      close(fd);
+      return false;
+    }
+    // every part is read front to back
+    madvise(data, _size, MADV_SEQUENTIAL);
+    _data = static_cast<const char*>(data);
+  }
+  close(fd);
+
+  _begin = _data;
+  _end = _data + _size;
+  if (_size >= CONTRACT_HEADER_SIZE && std::memcmp(_data, CONTRACT_FILE_MAGIC, 4) == 0) {
+    uint64_t header = load_le(_data);
+    uint16_t version = static_cast<uint16_t>((header >> 32) & 0xffff);
+    uint16_t record_size = static_cast<uint16_t>(header >> 48);
+    _count = load_le(_data + 8);
+    if (version != CONTRACT_FORMAT_VERSION || record_size != CONTRACT_RECORD_SIZE) {
+      error = path + ": unsupported contract file version " + std::to_string(version);
+      return false;
+    }
+    if ((_size - CONTRACT_HEADER_SIZE) / CONTRACT_RECORD_SIZE != _count || (_size - CONTRACT_HEADER_SIZE) % CONTRACT_RECORD_SIZE != 0) {
+      error = path + ": size does not match its " + std::to_string(_count) + " records";
+      return false;
+    }
+    _binary = true;
+    _begin = _data + CONTRACT_HEADER_SIZE;
+    return true;
+  }
+
+  if (is_header_line(_begin, _end)) {
+    _begin = next_line(_begin, _end);
+  }
+  return true;
+}
+
+ContractCursor ContractFile::part(unsigned i, unsigned n) const {
+  if (_binary) {
+    const char* begin = _begin + static_cast<size_t>(_count * i / n) * CONTRACT_RECORD_SIZE;
+    const char* end = _begin + static_cast<size_t>(_count * (i + 1) / n) * CONTRACT_RECORD_SIZE;
+    return ContractCursor(begin, end, true);
+  }
+
+  // a cut inside a line moves to the start of the next one, for both parts it separates
+  size_t total = static_cast<size_t>(_end - _begin);
+  auto cut = [this, total, n](unsigned k) {
+    const char* p = _begin + total / n * k + total % n * k / n;
+    return p > _begin && p < _end && p[-1] != '\n' ? next_line(p, _end) : p;
+  };
+  return ContractCursor(cut(i), cut(i + 1), false);
+}
+
+std::string ContractFile::location(const char* position) const {
+  if (_binary) {
+    return "record " + std::to_string((position - _begin) / static_cast<ptrdiff_t>(CONTRACT_RECORD_SIZE) + 1);
+  }
+  long lines = 1;
+  for (const char* p = _data; p < position; p++) {
+    lines += *p == '\n';
+  }
+  return "line " + std::to_string(lines);
+}
+
+}
@@ -0,0 +1,138 @@
+#ifndef MC_CONTRACT_INPUT_H
+#define MC_CONTRACT_INPUT_H
+
+// Contract input for the batch drivers, read in place from a memory-mapped file.
+//
+// Two formats:
+//
+//   CSV text   one contract per line, num_paths,S,K,r,v,T, commas or whitespace between
+//              the fields; blank lines and # comments are skipped, and so is a first line
+//              that does not start with a number (a header)
+//
+//   binary     fixed-size records (".mcc"), version 1, little-endian:
+//                file header
+//                  0   char[4]  magic "MCCT"
+//                  4   u16      format version
+//                  6   u16      record size in bytes, 48
+//                  8   u64      record count
+//                records, one after the other from offset 16
+//                  0   i64      num_paths
+//                  8   f64      S, K, r, v, T
+//
+// Nothing is copied out of the mapping but the contract being parsed, so a book of any
+// size is read with no per-contract allocation. A file is split into parts at record or
+// line boundaries by byte range, and each part is walked by its own ContractCursor, so
+// workers can parse and price their parts independently.
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "engine/mc_engine.h"
+
+namespace mc {
+
+static const char CONTRACT_FILE_MAGIC[4] = { 'M', 'C', 'C', 'T' };
+static const uint16_t CONTRACT_FORMAT_VERSION = 1;
+static const size_t CONTRACT_HEADER_SIZE = 16;
+static const size_t CONTRACT_RECORD_SIZE = 48;
+
+// header of a binary contract file of count records
+std::string contract_file_header(uint64_t count);
+
+// Writes the CONTRACT_RECORD_SIZE byte record of a contract.
+void encode_contract(Contract const& contract, char* record);
+
+Contract decode_contract(const char* record);
+
+// Parses a decimal number from [begin, end) without allocating; false unless the whole
+// range is one finite number.
+bool parse_decimal(const char* begin, const char* end, double& value);
+
+enum class ContractLine {
+  Contract,  // parsed into the contract
+  Blank,     // empty or a comment
+  Invalid    // not num_paths,S,K,r,v,T with positive S, K, v, T and an integral 1 <= num_paths < 2^31
+};
+
+// Parses one line of CSV input, without its newline.
+ContractLine parse_contract_line(const char* begin, const char* end, Contract& contract);
+
+// whether the first line of CSV input is a header: it does not start with a number
+bool is_header_line(const char* begin, const char* end);
+
+// Walks the contracts of one part of a contract file.
+class ContractCursor {
+  private:
+    const char* _pos;
+    const char* _end;
+    bool _binary;
+
+  public:
+    ContractCursor(const char* begin, const char* end, bool binary)
+      : _pos(begin), _end(end), _binary(binary) {}
+
+    // The next contract; false at the end of the part, or at a line that does not parse,
+    // in which case position() is the start of that line.
+    bool next(Contract& contract);
+
+    // number of contracts left in the part, counted without parsing them
+    size_t count() const;
+
+    bool at_end() const {
+      return _pos >= _end;
+    }
+
+    const char* position() const {
+      return _pos;
+    }
+};
+
+// A memory-mapped contract file of either format, read-only.
+class ContractFile {
+  private:
+    const char* _data = nullptr;
+    size_t _size = 0;
+    bool _binary = false;
+    const char* _begin = nullptr;  // first record or data line
+    const char* _end = nullptr;
+    uint64_t _count = 0;
+
+  public:
+    ContractFile() {}
+    ~ContractFile();
+
+    ContractFile(ContractFile const&) = delete;
+    ContractFile& operator=(ContractFile const&) = delete;
+
+    // Maps the file and detects its format; false with the reason in error.
+    bool open(std::string const& path, std::string& error);
+
+    bool binary() const {
+      return _binary;
+    }
+
+    size_t size() const {
+      return _size;
+    }
+
+    // number of records of a binary file; CSV files are counted with ContractCursor::count()
+    uint64_t record_count() const {
+      return _count;
+    }
+
+    // Part i of n, cut at record or line boundaries so every contract is in exactly one
+    // part. Parts are contiguous and in file order; short files leave some empty.
+    ContractCursor part(unsigned i, unsigned n) const;
+
+    ContractCursor all() const {
+      return part(0, 1);
+    }
+
+    // "line <n>" or "record <n>" (both 1-based) of a cursor position, for error messages
+    std::string location(const char* position) const;
+};
+
+}
+
+#endif
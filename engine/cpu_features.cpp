@@ -0,0 +1,81 @@
+#include "engine/cpu_features.h"
+
+#include <atomic>
+#include <cstdlib>
+
+namespace mc {
+
+namespace {
+
+Isa initial_isa() {
+  Isa isa;
+  const char* env = std::getenv("MC_ISA");
+  if (env && isa_from_string(env, isa) && isa_supported(isa)) {
+    return isa;
+  }
+  return detect_isa();
+}
+
+std::atomic<Isa>& active() {
+  static std::atomic<Isa> isa{initial_isa()};
+  return isa;
+}
+
+}
+
+const char* isa_name(Isa isa) {
+  switch (isa) {
+    case Isa::AVX2: return "avx2";
+    case Isa::AVX512: return "avx512";
+    default: return "sse2";
+  }
+}
+
+bool isa_from_string(std::string const& name, Isa& isa) {
+  const Isa all[] = { Isa::SSE2, Isa::AVX2, Isa::AVX512 };
+  for (Isa candidate : all) {
+    if (name == isa_name(candidate)) {
+      isa = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool isa_supported(Isa isa) {
+#if defined(__x86_64__) && defined(__GNUC__)
+  __builtin_cpu_init();
+  switch (isa) {
+    case Isa::AVX2:
+      return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    case Isa::AVX512:
+      return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq") &&
+             __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl") && isa_supported(Isa::AVX2);
+    default:
+      return true;
+  }
+#else
+  return isa == Isa::SSE2;
+#endif
+}
+
+Isa detect_isa() {
+  if (isa_supported(Isa::AVX512)) {
+    return Isa::AVX512;
+  }
+  return isa_supported(Isa::AVX2) ? Isa::AVX2 : Isa::SSE2;
+}
+
+Isa active_isa() {
+  return active().load(std::memory_order_relaxed);
+}
+
+bool set_isa(Isa isa) {
+  if (!isa_supported(isa)) {
+    return false;
+  }
+  active().store(isa, std::memory_order_relaxed);
+  return true;
+}
+
+}
@@ -0,0 +1,50 @@
+#ifndef MC_CPU_FEATURES_H
+#define MC_CPU_FEATURES_H
+
+// Instruction set levels the pricing kernels are compiled for, and the one they run at.
+//
+// The chunk kernels exist once per level in the same binary, each wrapper carrying a target
+// attribute, so the build needs no -march flags and the binary runs on any x86-64 CPU. The
+// level is picked from CPUID (through __builtin_cpu_supports, which also checks that the OS
+// saves the wider registers) the first time a kernel runs, and MC_ISA or set_isa() can force
+// a lower one for testing. Other architectures only have the baseline kernels.
+
+#include <cstdint>
+#include <string>
+
+namespace mc {
+
+enum class Isa : uint8_t {
+  SSE2,    // x86-64 baseline; the only level elsewhere
+  AVX2,    // AVX2 + FMA, 4 doubles / 8 floats per instruction
+  AVX512   // AVX-512 F/DQ/BW/VL, 8 doubles / 16 floats per instruction
+};
+
+// "sse2", "avx2" or "avx512"
+const char* isa_name(Isa isa);
+bool isa_from_string(std::string const& name, Isa& isa);
+
+bool isa_supported(Isa isa);
+
+// The highest level this CPU supports.
+Isa detect_isa();
+
+// The level the kernels run at: MC_ISA if it names a supported level, detect_isa() otherwise.
+Isa active_isa();
+
+// Forces the kernels to a level; false, and no change, if the CPU does not support it.
+bool set_isa(Isa isa);
+
+}
+
+// Attributes of the per-level kernel wrappers. flatten inlines the kernel template into the
+// wrapper, so its loops are vectorized, and exp resolved to libmvec, for that level.
+#if defined(__x86_64__) && defined(__GNUC__)
+#define MC_TARGET_AVX2 __attribute__((target("avx2,fma"), flatten))
+#define MC_TARGET_AVX512 __attribute__((target("avx512f,avx512dq,avx512bw,avx512vl,avx2,fma"), flatten))
+#else
+#define MC_TARGET_AVX2
+#define MC_TARGET_AVX512
+#endif
+
+#endif
@@ -0,0 +1,392 @@
+#include "engine/json_request.h"
+
+#include "engine/contract_input.h"
+
+#include <cmath>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace mc {
+
+namespace {
+
+// settings a batch contract leaves to the request, filled in once the request is read
+const Precision PRECISION_UNSET = static_cast<Precision>(0xff);
+const uint8_t SEEDED_UNSET = 2;
+
+const int MAX_DEPTH = 64;
+
+inline bool is_space(char c) {
+  return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
+inline bool is_number_char(char c) {
+  return (c >= '0' && c <= '9') || c == '.' || c == '-' || c == '+' || c == 'e' || c == 'E';
+}
+
+// first byte at or after p that is not whitespace
+const char* skip_space(const char* p, const char* end) {
+  // compact JSON has no whitespace or a single space between tokens
+  if (p < end && !is_space(*p)) {
+    return p;
+  }
+#if defined(__SSE2__)
+  while (end - p >= 16) {
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i space = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n'))),
+                                 _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('\t')), _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\r'))));
+    unsigned other = ~static_cast<unsigned>(_mm_movemask_epi8(space)) & 0xffffu;
+    if (other) {
+      return p + __builtin_ctz(other);
+    }
+    p += 16;
+  }
+#endif
+  while (p < end && is_space(*p)) {
+    p++;
+  }
+  return p;
+}
+
+// the closing quote of a string whose body starts at p, or end if there is none
+const char* string_end(const char* p, const char* end) {
+  for (;;) {
+#if defined(__SSE2__)
+    while (end - p >= 16) {
+      __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+      unsigned special = static_cast<unsigned>(_mm_movemask_epi8(
+          _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('"')), _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\\')))));
+      if (special) {
+        p += __builtin_ctz(special);
+        break;
+      }
+      p += 16;
+    }
+#endif
+    while (p < end && *p != '"' && *p != '\\') {
+      p++;
+    }
+    if (p >= end || *p == '"') {
+      return p;
+    }
+    // an escape: skip the backslash and the character after it
+    if (end - p <= 2) {
+      return end;
+    }
+    p += 2;
+  }
+}
+
+enum Key { PATHS, SPOT, STRIKE, RATE, VOLATILITY, MATURITY, SEED, PRECISION, CONTRACTS, LOG_LEVEL, OUTPUT_FORMAT, STATS, UNKNOWN };
+
+struct KeyName {
+  const char* name;
+  size_t size;
+};
+
+#define MC_JSON_KEY(name) { name, sizeof(name) - 1 }
+const KeyName KEYS[UNKNOWN] = {
+  MC_JSON_KEY("numberOfPaths"), MC_JSON_KEY("underlyingPrice"), MC_JSON_KEY("strikePrice"), MC_JSON_KEY("riskFreeRate"),
+  MC_JSON_KEY("volatility"), MC_JSON_KEY("maturity"), MC_JSON_KEY("seed"), MC_JSON_KEY("precision"),
+  MC_JSON_KEY("contracts"), MC_JSON_KEY("logLevel"), MC_JSON_KEY("outputFormat"), MC_JSON_KEY("stats")
+};
+#undef MC_JSON_KEY
+
+Key key_of(JsonString key) {
+  for (int k = 0; k < UNKNOWN; k++) {
+    if (KEYS[k].size == key.size && std::memcmp(KEYS[k].name, key.data, key.size) == 0) {
+      return static_cast<Key>(k);
+    }
+  }
+  return UNKNOWN;
+}
+
+bool precision_from_json(JsonString name, Precision& precision) {
+  const Precision all[] = { Precision::Double, Precision::Float, Precision::FloatKahan };
+  for (Precision candidate : all) {
+    if (name == precision_name(candidate)) {
+      precision = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Fields of one contract object, or of the request object around a contracts array.
+struct ContractFields {
+  double values[6] = { 0.0, 0.0, 0.0, JSON_DEFAULT_RATE, 0.0, JSON_DEFAULT_MATURITY };  // paths, S, K, r, v, T
+  bool present[6] = { false, false, false, false, false, false };
+  bool has_seed = false;
+  unsigned long long seed = 0;
+  bool has_precision = false;
+  Precision precision = Precision::Double;
+};
+
+class RequestParser {
+  private:
+    const char* _p;
+    const char* _end;
+    ContractBatch& _batch;
+    JsonRequest& _request;
+    bool _has_contracts = false;
+
+    bool fail(JsonError error, std::string message) {
+      if (_request.error == JsonError::None) {
+        _request.error = error;
+        _request.message = std::move(message);
+      }
+      return false;
+    }
+
+    bool consume(char c) {
+      _p = skip_space(_p, _end);
+      if (_p < _end && *_p == c) {
+        _p++;
+        return true;
+      }
+      return false;
+    }
+
+    bool peek(char c) {
+      _p = skip_space(_p, _end);
+      return _p < _end && *_p == c;
+    }
+
+    bool string_value(JsonString& out) {
+      if (!consume('"')) {
+        return false;
+      }
+      const char* close = string_end(_p, _end);
+      if (close >= _end) {
+        return false;
+      }
+      out.data = _p;
+      out.size = static_cast<size_t>(close - _p);
+      _p = close + 1;
+      return true;
+    }
+
+    bool number_value(double& value) {
+      _p = skip_space(_p, _end);
+      const char* begin = _p;
+      while (_p < _end && is_number_char(*_p)) {
+        _p++;
+      }
+      return parse_decimal(begin, _p, value);
+    }
+
+    bool unsigned_value(unsigned long long& value) {
+      _p = skip_space(_p, _end);
+      const char* begin = _p;
+      value = 0;
+      for (; _p < _end && *_p >= '0' && *_p <= '9' && _p - begin < 20; _p++) {
+        value = value * 10 + static_cast<unsigned long long>(*_p - '0');
+      }
+      // at most 19 digits, so no overflow; no fraction or exponent
+      return _p > begin && _p - begin < 20 && (_p == _end || !is_number_char(*_p));
+    }
+
+    bool literal(const char* word) {
+      _p = skip_space(_p, _end);
+      size_t n = std::strlen(word);
+      if (static_cast<size_t>(_end - _p) >= n && std::memcmp(_p, word, n) == 0) {
+        _p += n;
+        return true;
+      }
+      return false;
+    }
+
+    // any value, for keys the schema does not use
+    bool skip_value(int depth) {
+      _p = skip_space(_p, _end);
+      if (depth > MAX_DEPTH || _p == _end) {
+        return false;
+      }
+      JsonString text;
+      double number;
+      if (peek('"')) {
+        return string_value(text);
+      }
+      if (consume('{')) {
+        if (consume('}')) {
+          return true;
+        }
+        do {
+          if (!string_value(text) || !consume(':') || !skip_value(depth + 1)) {
+            return false;
+          }
+        } while (consume(','));
+        return consume('}');
+      }
+      if (consume('[')) {
+        if (consume(']')) {
+          return true;
+        }
+        do {
+          if (!skip_value(depth + 1)) {
+            return false;
+          }
+        } while (consume(','));
+        return consume(']');
+      }
+      return literal("true") || literal("false") || literal("null") || number_value(number);
+    }
+
+    // Appends a contract; settings it does not have are left to the request.
+    bool add_contract(ContractFields const& fields) {
+      for (int i : { PATHS, SPOT, STRIKE, VOLATILITY }) {
+        if (!fields.present[i]) {
+          return fail(JsonError::Contract, std::string("missing ") + KEYS[i].name);
+        }
+      }
+      const double* v = fields.values;
+      if (v[PATHS] != std::floor(v[PATHS])) {
+        return fail(JsonError::Contract, "numberOfPaths of contract " + std::to_string(_batch.size()) + " is not a whole number");
+      }
+      if (v[PATHS] < 1 || v[PATHS] > 2147483647.0 || v[SPOT] <= 0 || v[STRIKE] <= 0 || v[VOLATILITY] <= 0 || v[MATURITY] <= 0) {
+        return fail(JsonError::Contract, "contract " + std::to_string(_batch.size()) + " is out of range");
+      }
+      _batch.contracts.push_back(Contract{static_cast<int>(v[PATHS]), v[SPOT], v[STRIKE], v[RATE], v[VOLATILITY], v[MATURITY]});
+      _batch.precisions.push_back(fields.has_precision ? fields.precision : PRECISION_UNSET);
+      _batch.seeded.push_back(fields.has_seed ? 1 : SEEDED_UNSET);
+      _batch.seeds.push_back(fields.seed);
+      return true;
+    }
+
+    bool contracts_array() {
+      if (!consume('[')) {
+        return fail(JsonError::Malformed, "contracts must be an array");
+      }
+      if (consume(']')) {
+        return true;
+      }
+      do {
+        ContractFields fields;
+        if (!object(fields, false) || !add_contract(fields)) {
+          return false;
+        }
+      } while (consume(','));
+      return consume(']') || fail(JsonError::Malformed, "expected , or ]");
+    }
+
+    bool object(ContractFields& fields, bool top_level) {
+      if (!consume('{')) {
+        return fail(JsonError::Malformed, "expected an object");
+      }
+      if (consume('}')) {
+        return true;
+      }
+      do {
+        JsonString key;
+        if (!string_value(key) || !consume(':')) {
+          return fail(JsonError::Malformed, "expected a key");
+        }
+        Key k = key_of(key);
+        if (k <= MATURITY) {
+          if (!number_value(fields.values[k])) {
+            return fail(JsonError::Malformed, key.str() + " must be a number");
+          }
+          fields.present[k] = true;
+          continue;
+        }
+        if (!top_level && k >= CONTRACTS) {
+          k = UNKNOWN;
+        }
+        switch (k) {
+          case SEED:
+            if (!unsigned_value(fields.seed)) {
+              return fail(JsonError::Malformed, "seed must be a non-negative integer");
+            }
+            fields.has_seed = true;
+            break;
+          case PRECISION: {
+            JsonString name;
+            if (!string_value(name)) {
+              return fail(JsonError::Malformed, "precision must be a string");
+            }
+            if (!precision_from_json(name, fields.precision)) {
+              return fail(JsonError::Precision, "Unknown precision " + name.str());
+            }
+            fields.has_precision = true;
+            break;
+          }
+          case CONTRACTS:
+            if (!contracts_array()) {
+              return false;
+            }
+            _has_contracts = true;
+            break;
+          case LOG_LEVEL:
+          case OUTPUT_FORMAT:
+            if (!string_value(k == LOG_LEVEL ? _request.log_level : _request.output_format)) {
+              return fail(JsonError::Malformed, key.str() + " must be a string");
+            }
+            break;
+          case STATS:
+            _request.stats = literal("true");
+            if (!_request.stats && !literal("false")) {
+              return fail(JsonError::Malformed, "stats must be true or false");
+            }
+            break;
+          default:
+            if (!skip_value(0)) {
+              return fail(JsonError::Malformed, "malformed value of " + key.str());
+            }
+        }
+      } while (consume(','));
+      return consume('}') || fail(JsonError::Malformed, "expected , or }");
+    }
+
+    // request settings for the contracts that have none of their own
+    void apply_request_settings(size_t first, ContractFields const& request) {
+      for (size_t i = first; i < _batch.size(); i++) {
+        if (_batch.precisions[i] == PRECISION_UNSET) {
+          _batch.precisions[i] = request.precision;
+        }
+        if (_batch.seeded[i] == SEEDED_UNSET) {
+          _batch.seeded[i] = request.has_seed;
+          _batch.seeds[i] = request.seed;
+        }
+      }
+    }
+
+  public:
+    RequestParser(const char* begin, const char* end, ContractBatch& batch, JsonRequest& request)
+      : _p(begin), _end(end), _batch(batch), _request(request) {}
+
+    bool parse() {
+      size_t first = _batch.size();
+      ContractFields fields;
+      if (!object(fields, true)) {
+        return false;
+      }
+      if (skip_space(_p, _end) != _end) {
+        return fail(JsonError::Malformed, "trailing characters after the request");
+      }
+      // without a contracts array the request is the contract
+      if (!_has_contracts && !_request.stats && !add_contract(fields)) {
+        return false;
+      }
+      apply_request_settings(first, fields);
+      return true;
+    }
+};
+
+}
+
+bool parse_json_request(const char* begin, const char* end, ContractBatch& batch, JsonRequest& request) {
+  size_t size = batch.size();
+  if (RequestParser(begin, end, batch, request).parse()) {
+    return true;
+  }
+  if (request.error == JsonError::None) {
+    request.error = JsonError::Malformed;
+    request.message = "malformed request";
+  }
+  batch.resize(size);
+  return false;
+}
+
+}
@@ -0,0 +1,106 @@
+#ifndef MC_JSON_REQUEST_H
+#define MC_JSON_REQUEST_H
+
+// Pricing requests in JSON, as the Lambda function and mcserver take them:
+//
+//   {"numberOfPaths": 100000, "underlyingPrice": 100, "strikePrice": 100, "volatility": 0.2,
+//    "riskFreeRate": 0.5, "maturity": 1, "seed": 1, "precision": "double"}
+//   {"contracts": [{...}, ...], "seed": 1, "precision": "float", "outputFormat": "binary"}
+//
+// riskFreeRate and maturity default to 0.5 and 1; seed and precision apply to the whole
+// request or, overriding it, to one contract.
+//
+// The payload is read in place, in one pass: keys are matched where they are, numbers are
+// converted with parse_decimal, and every contract is appended straight to the columns of a
+// ContractBatch, so a batch of any size is read without building a document or copying a
+// string out of the payload. Runs of whitespace and string bodies are scanned 16 bytes at a
+// time with SSE2 where the target has it. A malformed request is rejected with the reason,
+// leaving the batch as it was.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "engine/mc_engine.h"
+
+namespace mc {
+
+static const double JSON_DEFAULT_RATE = 0.5;
+static const double JSON_DEFAULT_MATURITY = 1.0;
+
+// Contracts to price with their settings, one column per field. Columns keep their
+// capacity across clear(), so a reused batch stops allocating once it has seen its
+// largest request.
+struct ContractBatch {
+  std::vector<Contract> contracts;
+  std::vector<Precision> precisions;
+  std::vector<uint8_t> seeded;
+  std::vector<unsigned long long> seeds;
+
+  size_t size() const {
+    return contracts.size();
+  }
+
+  void clear() {
+    resize(0);
+  }
+
+  void resize(size_t size) {
+    contracts.resize(size);
+    precisions.resize(size);
+    seeded.resize(size);
+    seeds.resize(size);
+  }
+
+  void add(Contract const& contract, Precision precision, bool is_seeded, unsigned long long seed) {
+    contracts.push_back(contract);
+    precisions.push_back(precision);
+    seeded.push_back(is_seeded);
+    seeds.push_back(seed);
+  }
+};
+
+// A string value in the payload, between its quotes and not unescaped; the values the
+// schema knows are plain ASCII.
+struct JsonString {
+  const char* data = nullptr;
+  size_t size = 0;
+
+  bool empty() const {
+    return size == 0;
+  }
+
+  bool operator==(const char* text) const {
+    return std::strlen(text) == size && std::memcmp(data, text, size) == 0;
+  }
+
+  std::string str() const {
+    return std::string(data, size);
+  }
+};
+
+enum class JsonError {
+  None,
+  Malformed,  // not JSON, or a field of the wrong type
+  Precision,  // an unknown precision name
+  Contract    // a contract field missing or out of range
+};
+
+// The request fields besides its contracts.
+struct JsonRequest {
+  JsonString log_level;       // "logLevel"
+  JsonString output_format;   // "outputFormat"
+  bool stats = false;         // "stats": true, for mcserver
+  JsonError error = JsonError::None;
+  std::string message;        // why the request was rejected
+};
+
+// Parses the request in [begin, end) and appends its contracts to batch. A request with
+// "stats": true needs no contract. False on error, with error and message set in request.
+bool parse_json_request(const char* begin, const char* end, ContractBatch& batch, JsonRequest& request);
+
+}
+
+#endif
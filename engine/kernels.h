@@ -0,0 +1,60 @@
+#ifndef MC_KERNELS_H
+#define MC_KERNELS_H
+
+// The per-chunk stages of the pricing loop, exposed so benchmarks can time each one in
+// isolation. They are compiled as part of mcengine, with its optimisation flags.
+
+#include "engine/mc_engine.h"
+
+namespace mc {
+
+// per-contract constants, hoisted out of the path loops
+struct PathParams {
+  double S_adjust;    // S * exp(T*(r-0.5*v*v))
+  double vol_sqrt_T;  // v * sqrt(T)
+  double K;
+  double discount;    // exp(-r*T)
+
+  explicit PathParams(Contract const& c);
+};
+
+// payoff sums and sums of squared payoffs, for the mean and its standard error. Kernels
+// take a pair of payoffs; call and put hold the first and second, and a single product is
+// priced paired with NoPayoff.
+struct PayoffSums {
+  double call;
+  double put;
+  double call_sq;
+  double put_sq;
+};
+
+// Fills n standard normals from the worker's stream into out.
+void draw_normals(WorkerState& state, double* out, int n);
+void draw_normals(WorkerState& state, float* out, int n);
+
+// S(T) for each normal: S_adjust * exp(vol_sqrt_T * gauss[i]).
+void terminal_prices(const double* gauss, int n, PathParams const& p, double* S_T);
+void terminal_prices(const float* gauss, int n, PathParams const& p, float* S_T);
+
+// Call and put payoff (and squared payoff) sums over already evolved terminal prices,
+// accumulated in double.
+PayoffSums payoff_sums_terminal(const double* S_T, int n, double K);
+PayoffSums payoff_sums_terminal(const float* S_T, int n, double K);
+
+// The same over float prices, accumulated in float with Kahan compensation. Built without
+// associative math, which would optimise the compensation away. The template is
+// instantiated for call and put and for every product paired with NoPayoff.
+PayoffSums payoff_sums_terminal_kahan(const float* S_T, int n, float K);
+template <class First, class Second>
+PayoffSums payoff_sums_terminal_kahan(const float* S_T, int n, First const& first, Second const& second);
+
+// Fused kernel used by the engine: evolves and accumulates both payoffs in one pass.
+PayoffSums payoff_sums(const double* gauss, int n, PathParams const& p);
+PayoffSums payoff_sums(const float* gauss, int n, PathParams const& p);
+
+// Plain sum, the reduction the engine applies to per-worker partial sums.
+double sum(const double* x, int n);
+
+}
+
+#endif
@@ -0,0 +1,98 @@
+#include "engine/kernels.h"
+
+// Built with -fno-associative-math (see CMakeLists.txt): with reassociation allowed the
+// compiler may fold the compensation (t - sum) - y to zero, leaving a plain sum. The rest
+// of -ffast-math stays on, so max() still becomes a vector instruction.
+
+namespace mc {
+
+namespace {
+
+// independent accumulators; each lane is compensated on its own, so the loop vectorizes
+// without reassociating any sum
+const int KAHAN_LANES = 8;
+
+struct KahanLanes {
+  float sum[KAHAN_LANES] = {};
+  float compensation[KAHAN_LANES] = {};
+
+  void add(int lane, float x) {
+    float y = x - compensation[lane];
+    float t = sum[lane] + y;
+    compensation[lane] = (t - sum[lane]) - y;
+    sum[lane] = t;
+  }
+
+  double total() const {
+    double total = 0.0;
+    for (int lane = 0; lane < KAHAN_LANES; lane++) {
+      total += static_cast<double>(sum[lane]) - static_cast<double>(compensation[lane]);
+    }
+    return total;
+  }
+};
+
+template <class First, class Second>
+PayoffSums kahan_sums(const float* S_T, int n, First const& first, Second const& second) {
+  static_assert(is_terminal_payoff<First>::value && is_terminal_payoff<Second>::value,
+                "the engine simulates S(T) only; path-dependent payoffs need a path kernel");
+  KahanLanes call, put, call_sq, put_sq;
+  // always inlined: under PGO this out-of-line copy has no counts of its own (the wrappers
+  // below inline it), and a call left in the block loop would stop it vectorizing
+  auto add = [&](int lane, float S) __attribute__((always_inline)) {
+    float call_payoff = first(S);
+    float put_payoff = second(S);
+    call.add(lane, call_payoff);
+    put.add(lane, put_payoff);
+    call_sq.add(lane, call_payoff * call_payoff);
+    put_sq.add(lane, put_payoff * put_payoff);
+  };
+
+  // full blocks with a constant lane count, so each block is one vector operation per step
+  int full = n - n % KAHAN_LANES;
+  for (int i = 0; i < full; i += KAHAN_LANES) {
+    for (int lane = 0; lane < KAHAN_LANES; lane++) {
+      add(lane, S_T[i + lane]);
+    }
+  }
+  for (int i = full; i < n; i++) {
+    add(i - full, S_T[i]);
+  }
+  return PayoffSums{call.total(), put.total(), call_sq.total(), put_sq.total()};
+}
+
+// one copy per instruction set level, as for the other kernels (see mc_engine.cpp)
+#define MC_ISA_KERNELS(Name, attributes) \
+  struct Name { \
+    template <class First, class Second> \
+    attributes static PayoffSums payoffs(const float* S_T, int n, First const& first, Second const& second) { \
+      return kahan_sums(S_T, n, first, second); \
+    } \
+  };
+MC_ISA_KERNELS(Sse2Kernels, )
+MC_ISA_KERNELS(Avx2Kernels, MC_TARGET_AVX2)
+MC_ISA_KERNELS(Avx512Kernels, MC_TARGET_AVX512)
+#undef MC_ISA_KERNELS
+
+}
+
+template <class First, class Second>
+PayoffSums payoff_sums_terminal_kahan(const float* S_T, int n, First const& first, Second const& second) {
+  switch (active_isa()) {
+    case Isa::AVX512: return Avx512Kernels::payoffs(S_T, n, first, second);
+    case Isa::AVX2: return Avx2Kernels::payoffs(S_T, n, first, second);
+    default: return Sse2Kernels::payoffs(S_T, n, first, second);
+  }
+}
+
+PayoffSums payoff_sums_terminal_kahan(const float* S_T, int n, float K) {
+  return payoff_sums_terminal_kahan(S_T, n, CallPayoff(K), PutPayoff(K));
+}
+
+template PayoffSums payoff_sums_terminal_kahan<CallPayoff, PutPayoff>(const float*, int, CallPayoff const&, PutPayoff const&);
+#define MC_INSTANTIATE_KAHAN(Payoff) \
+  template PayoffSums payoff_sums_terminal_kahan<Payoff, NoPayoff>(const float*, int, Payoff const&, NoPayoff const&);
+MC_FOR_EACH_PRODUCT(MC_INSTANTIATE_KAHAN)
+#undef MC_INSTANTIATE_KAHAN
+
+}
@@ -0,0 +1,707 @@
+#include "engine/mc_engine.h"
+#include "engine/kernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <new>
+
+namespace mc {
+
+PathParams::PathParams(Contract const& c)
+  : S_adjust(c.S * exp(c.T*(c.r-0.5*c.v*c.v))), vol_sqrt_T(sqrt(c.v*c.v*c.T)), K(c.K), discount(exp(-c.r*c.T)) {}
+
+namespace {
+
+template <class Real>
+void terminal_prices_impl(const Real* gauss, int n, PathParams const& p, Real* S_T) {
+  const Real S_adjust = static_cast<Real>(p.S_adjust);
+  const Real vol_sqrt_T = static_cast<Real>(p.vol_sqrt_T);
+  for (int i = 0; i < n; i++) {
+    S_T[i] = S_adjust * std::exp(vol_sqrt_T*gauss[i]);
+  }
+}
+
+template <class Real, class First, class Second>
+PayoffSums payoff_sums_terminal_impl(const Real* S_T, int n, First const& first, Second const& second) {
+  static_assert(is_terminal_payoff<First>::value && is_terminal_payoff<Second>::value,
+                "the engine simulates S(T) only; path-dependent payoffs need a path kernel");
+  double call_sum = 0.0;
+  double put_sum = 0.0;
+  double call_sq = 0.0;
+  double put_sq = 0.0;
+  for (int i = 0; i < n; i++) {
+    double call = first(S_T[i]);
+    double put = second(S_T[i]);
+    call_sum += call;
+    put_sum += put;
+    call_sq += call * call;
+    put_sq += put * put;
+  }
+  return PayoffSums{call_sum, put_sum, call_sq, put_sq};
+}
+
+// inner kernel: no branches and no I/O, so it compiles to a SIMD loop; paths are evolved
+// in Real, payoffs accumulated in double. The payoffs are inlined, so every product gets
+// its own loop.
+template <class Real, class First, class Second>
+PayoffSums payoff_sums_impl(const Real* gauss, int n, PathParams const& p, First const& first, Second const& second) {
+  static_assert(is_terminal_payoff<First>::value && is_terminal_payoff<Second>::value,
+                "the engine simulates S(T) only; path-dependent payoffs need a path kernel");
+  const Real S_adjust = static_cast<Real>(p.S_adjust);
+  const Real vol_sqrt_T = static_cast<Real>(p.vol_sqrt_T);
+  double call_sum = 0.0;
+  double put_sum = 0.0;
+  double call_sq = 0.0;
+  double put_sq = 0.0;
+  for (int i = 0; i < n; i++) {
+    Real S_cur = S_adjust * std::exp(vol_sqrt_T*gauss[i]);
+    double call = first(S_cur);
+    double put = second(S_cur);
+    call_sum += call;
+    put_sum += put;
+    call_sq += call * call;
+    put_sq += put * put;
+  }
+  return PayoffSums{call_sum, put_sum, call_sq, put_sq};
+}
+
+// The chunk kernels once per instruction set level, see engine/cpu_features.h.
+#define MC_ISA_KERNELS(Name, attributes) \
+  struct Name { \
+    template <class Real> \
+    attributes static void terminal(const Real* gauss, int n, PathParams const& p, Real* S_T) { \
+      terminal_prices_impl(gauss, n, p, S_T); \
+    } \
+    template <class Real, class First, class Second> \
+    attributes static PayoffSums payoffs(const Real* S_T, int n, First const& first, Second const& second) { \
+      return payoff_sums_terminal_impl(S_T, n, first, second); \
+    } \
+    template <class Real, class First, class Second> \
+    attributes static PayoffSums fused(const Real* gauss, int n, PathParams const& p, First const& first, Second const& second) { \
+      return payoff_sums_impl(gauss, n, p, first, second); \
+    } \
+  };
+MC_ISA_KERNELS(Sse2Kernels, )
+MC_ISA_KERNELS(Avx2Kernels, MC_TARGET_AVX2)
+MC_ISA_KERNELS(Avx512Kernels, MC_TARGET_AVX512)
+#undef MC_ISA_KERNELS
+
+// dispatch to the active level; once per chunk, so the switch costs nothing measurable
+template <class Real>
+void terminal_prices_isa(const Real* gauss, int n, PathParams const& p, Real* S_T) {
+  switch (active_isa()) {
+    case Isa::AVX512: return Avx512Kernels::terminal(gauss, n, p, S_T);
+    case Isa::AVX2: return Avx2Kernels::terminal(gauss, n, p, S_T);
+    default: return Sse2Kernels::terminal(gauss, n, p, S_T);
+  }
+}
+
+template <class Real, class First, class Second>
+PayoffSums payoff_sums_terminal_isa(const Real* S_T, int n, First const& first, Second const& second) {
+  switch (active_isa()) {
+    case Isa::AVX512: return Avx512Kernels::payoffs(S_T, n, first, second);
+    case Isa::AVX2: return Avx2Kernels::payoffs(S_T, n, first, second);
+    default: return Sse2Kernels::payoffs(S_T, n, first, second);
+  }
+}
+
+template <class Real, class First, class Second>
+PayoffSums payoff_sums_isa(const Real* gauss, int n, PathParams const& p, First const& first, Second const& second) {
+  switch (active_isa()) {
+    case Isa::AVX512: return Avx512Kernels::fused(gauss, n, p, first, second);
+    case Isa::AVX2: return Avx2Kernels::fused(gauss, n, p, first, second);
+    default: return Sse2Kernels::fused(gauss, n, p, first, second);
+  }
+}
+
+}
+
+void draw_normals(WorkerState& state, double* out, int n) {
+  for (int j = 0; j < n; j++) {
+    out[j] = state.distribution(state.gen);
+  }
+}
+
+void draw_normals(WorkerState& state, float* out, int n) {
+  for (int j = 0; j < n; j++) {
+    out[j] = state.distribution_f(state.gen);
+  }
+}
+
+void terminal_prices(const double* gauss, int n, PathParams const& p, double* S_T) {
+  terminal_prices_isa(gauss, n, p, S_T);
+}
+
+void terminal_prices(const float* gauss, int n, PathParams const& p, float* S_T) {
+  terminal_prices_isa(gauss, n, p, S_T);
+}
+
+PayoffSums payoff_sums_terminal(const double* S_T, int n, double K) {
+  return payoff_sums_terminal_isa(S_T, n, CallPayoff(K), PutPayoff(K));
+}
+
+PayoffSums payoff_sums_terminal(const float* S_T, int n, double K) {
+  return payoff_sums_terminal_isa(S_T, n, CallPayoff(K), PutPayoff(K));
+}
+
+PayoffSums payoff_sums(const double* gauss, int n, PathParams const& p) {
+  return payoff_sums_isa(gauss, n, p, CallPayoff(p.K), PutPayoff(p.K));
+}
+
+PayoffSums payoff_sums(const float* gauss, int n, PathParams const& p) {
+  return payoff_sums_isa(gauss, n, p, CallPayoff(p.K), PutPayoff(p.K));
+}
+
+double sum(const double* x, int n) {
+  double total = 0.0;
+  for (int i = 0; i < n; i++) {
+    total += x[i];
+  }
+  return total;
+}
+
+const char* precision_name(Precision precision) {
+  switch (precision) {
+    case Precision::Float: return "float";
+    case Precision::FloatKahan: return "float-kahan";
+    default: return "double";
+  }
+}
+
+bool precision_from_string(std::string const& name, Precision& precision) {
+  const Precision all[] = { Precision::Double, Precision::Float, Precision::FloatKahan };
+  for (Precision candidate : all) {
+    if (name == precision_name(candidate)) {
+      precision = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+namespace {
+
+// Precision policies for the slice loop: the path type, the worker's chunk buffers for it
+// and the chunk kernel. prepare() starts a job on the worker's arena and takes the buffers
+// it needs from it. timed() is the same kernel with its stages timed: one PHASE_PATH for
+// the fused kernels, which evolve and price each path in one pass, so a run prices to the
+// same bits with metrics on or off.
+struct DoublePaths {
+  typedef double real;
+
+  static void prepare(WorkerState& s) {
+    s.arena.reset();
+    s.gauss = s.arena.allocate<double>(PATH_CHUNK);
+  }
+  static real* normals(WorkerState& s) { return s.gauss; }
+
+  template <class First, class Second>
+  static PayoffSums fused(WorkerState&, const real* gauss, int n, PathParams const& p, First const& first, Second const& second) {
+    return payoff_sums_isa(gauss, n, p, first, second);
+  }
+  template <class First, class Second>
+  static PayoffSums timed(WorkerState& s, const real* gauss, int n, PathParams const& p, First const& first, Second const& second) {
+    ScopedTimer timer(PHASE_PATH, static_cast<uint64_t>(n));
+    return fused(s, gauss, n, p, first, second);
+  }
+};
+
+struct FloatPaths {
+  typedef float real;
+
+  static void prepare(WorkerState& s) {
+    s.arena.reset();
+    s.gauss_f = s.arena.allocate<float>(PATH_CHUNK);
+  }
+  static real* normals(WorkerState& s) { return s.gauss_f; }
+
+  template <class First, class Second>
+  static PayoffSums fused(WorkerState&, const real* gauss, int n, PathParams const& p, First const& first, Second const& second) {
+    return payoff_sums_isa(gauss, n, p, first, second);
+  }
+  template <class First, class Second>
+  static PayoffSums timed(WorkerState& s, const real* gauss, int n, PathParams const& p, First const& first, Second const& second) {
+    ScopedTimer timer(PHASE_PATH, static_cast<uint64_t>(n));
+    return fused(s, gauss, n, p, first, second);
+  }
+};
+
+// Kahan summation lives in its own translation unit, so it is always two passes, and the
+// passes are timed as PHASE_PATH and PHASE_PAYOFF
+struct FloatKahanPaths : FloatPaths {
+  static void prepare(WorkerState& s) {
+    FloatPaths::prepare(s);
+    s.terminal_f = s.arena.allocate<float>(PATH_CHUNK);
+  }
+
+  template <class First, class Second>
+  static PayoffSums fused(WorkerState& s, const real* gauss, int n, PathParams const& p, First const& first, Second const& second) {
+    terminal_prices(gauss, n, p, s.terminal_f);
+    return payoff_sums_terminal_kahan(s.terminal_f, n, first, second);
+  }
+  template <class First, class Second>
+  static PayoffSums timed(WorkerState& s, const real* gauss, int n, PathParams const& p, First const& first, Second const& second) {
+    uint64_t items = static_cast<uint64_t>(n);
+    {
+      ScopedTimer timer(PHASE_PATH, items);
+      terminal_prices(gauss, n, p, s.terminal_f);
+    }
+    ScopedTimer timer(PHASE_PAYOFF, items);
+    return payoff_sums_terminal_kahan(s.terminal_f, n, first, second);
+  }
+};
+
+// one worker's share of the paths, a chunk at a time; with Report=false the progress hook
+// is compiled out entirely. Timed runs time each stage of the chunk through the policy's
+// timed(), which runs the same kernel as an untimed run. Chunk sums are always added up in
+// double.
+template <class Paths, bool Report, bool Timed, class First, class Second>
+PayoffSums payoff_sums_slice(WorkerState& state, ProgressReporter* progress, int begin, int end, PathParams const& p,
+                             First const& first, Second const& second) {
+  Paths::prepare(state);
+  typename Paths::real* gauss = Paths::normals(state);
+  PayoffSums sums{0.0, 0.0, 0.0, 0.0};
+
+  for (int i = begin; i < end; i += PATH_CHUNK) {
+    int n = std::min(PATH_CHUNK, end - i);
+    PayoffSums chunk;
+    if (Timed) {
+      {
+        ScopedTimer timer(PHASE_RNG, static_cast<uint64_t>(n));
+        draw_normals(state, gauss, n);
+      }
+      chunk = Paths::timed(state, gauss, n, p, first, second);
+    } else {
+      draw_normals(state, gauss, n);
+      chunk = Paths::fused(state, gauss, n, p, first, second);
+    }
+    sums.call += chunk.call;
+    sums.put += chunk.put;
+    sums.call_sq += chunk.call_sq;
+    sums.put_sq += chunk.put_sq;
+    if (Report) {
+      progress->on_chunk(n);
+    }
+  }
+  return sums;
+}
+
+template <class Paths, bool Report, class First, class Second>
+PayoffSums payoff_sums_slice(WorkerState& state, ProgressReporter* progress, int begin, int end, PathParams const& p,
+                             First const& first, Second const& second) {
+  return metrics_enabled()
+    ? payoff_sums_slice<Paths, Report, true>(state, progress, begin, end, p, first, second)
+    : payoff_sums_slice<Paths, Report, false>(state, progress, begin, end, p, first, second);
+}
+
+template <bool Report, class First, class Second>
+PayoffSums payoff_sums_slice(Precision precision, WorkerState& state, ProgressReporter* progress, int begin, int end,
+                             PathParams const& p, First const& first, Second const& second) {
+  switch (precision) {
+    case Precision::Float:
+      return payoff_sums_slice<FloatPaths, Report>(state, progress, begin, end, p, first, second);
+    case Precision::FloatKahan:
+      return payoff_sums_slice<FloatKahanPaths, Report>(state, progress, begin, end, p, first, second);
+    default:
+      return payoff_sums_slice<DoublePaths, Report>(state, progress, begin, end, p, first, second);
+  }
+}
+
+// one worker's share of the paths of a batch with a common num_sims: every chunk of
+// normals is evolved for each contract, with its sums added to sums[contract]
+template <class Paths>
+void shared_sums_slice(WorkerState& state, int begin, int end, PathParams const* params, size_t count, PayoffSums* sums) {
+  Paths::prepare(state);
+  typename Paths::real* gauss = Paths::normals(state);
+
+  for (int i = begin; i < end; i += PATH_CHUNK) {
+    int n = std::min(PATH_CHUNK, end - i);
+    {
+      ScopedTimer timer(PHASE_RNG, static_cast<uint64_t>(n));
+      draw_normals(state, gauss, n);
+    }
+    ScopedTimer timer(PHASE_PATH, static_cast<uint64_t>(n) * count);
+    for (size_t c = 0; c < count; c++) {
+      PayoffSums chunk = Paths::fused(state, gauss, n, params[c], CallPayoff(params[c].K), PutPayoff(params[c].K));
+      sums[c].call += chunk.call;
+      sums[c].put += chunk.put;
+      sums[c].call_sq += chunk.call_sq;
+      sums[c].put_sq += chunk.put_sq;
+    }
+  }
+}
+
+void shared_sums_slice(Precision precision, WorkerState& state, int begin, int end, PathParams const* params, size_t count, PayoffSums* sums) {
+  switch (precision) {
+    case Precision::Float:
+      return shared_sums_slice<FloatPaths>(state, begin, end, params, count, sums);
+    case Precision::FloatKahan:
+      return shared_sums_slice<FloatKahanPaths>(state, begin, end, params, count, sums);
+    default:
+      return shared_sums_slice<DoublePaths>(state, begin, end, params, count, sums);
+  }
+}
+
+// paths handled by worker w out of n: [begin, end)
+int slice_begin(int num_sims, unsigned w, unsigned n) {
+  return static_cast<int>(static_cast<long long>(num_sims) * w / n);
+}
+
+// Seeded runs: [block_begin(b), block_end(b)) are the paths of block b.
+int block_count(int num_sims) {
+  return num_sims > 0 ? (num_sims - 1) / SEEDED_BLOCK + 1 : 0;
+}
+
+int block_begin(int block) {
+  return block * SEEDED_BLOCK;
+}
+
+int block_end(int num_sims, int block) {
+  return static_cast<int>(std::min(static_cast<long long>(block + 1) * SEEDED_BLOCK, static_cast<long long>(num_sims)));
+}
+
+PayoffSums operator+(PayoffSums const& a, PayoffSums const& b) {
+  return PayoffSums{a.call + b.call, a.put + b.put, a.call_sq + b.call_sq, a.put_sq + b.put_sq};
+}
+
+// Adds block sums up, in block order, in a tree fixed by their count alone: pairs of
+// blocks, pairs of pairs and so on, as the carries of a binary counter, and at the end
+// the partial sums left over, right to left. It needs no storage but one partial sum per
+// bit of the count, so a serial run reduces its blocks as it goes and a parallel one
+// reduces the blocks its workers stored, to the same bits.
+class PairwiseSum {
+  private:
+    PayoffSums _partial[32];
+    int _depth = 0;
+    unsigned _count = 0;
+
+  public:
+    void add(PayoffSums sums) {
+      for (unsigned carry = _count++; carry & 1; carry >>= 1) {
+        sums = _partial[--_depth] + sums;
+      }
+      _partial[_depth++] = sums;
+    }
+
+    PayoffSums total() const {
+      if (_depth == 0) {
+        return PayoffSums{0.0, 0.0, 0.0, 0.0};
+      }
+      PayoffSums sums = _partial[_depth - 1];
+      for (int i = _depth - 2; i >= 0; i--) {
+        sums = _partial[i] + sums;
+      }
+      return sums;
+    }
+};
+
+// count sums, stride apart
+PayoffSums pairwise_sum(const PayoffSums* sums, size_t count, size_t stride) {
+  PairwiseSum total;
+  for (size_t i = 0; i < count; i++) {
+    total.add(sums[i * stride]);
+  }
+  return total.total();
+}
+
+// A worker's share of the blocks of a seeded run, [first_block, last_block), each from its
+// own stream; its sums are stored at blocks[block].
+template <bool Report, class First, class Second>
+void block_sums_slice(Precision precision, WorkerState& state, ProgressReporter* progress, int num_sims, int first_block,
+                      int last_block, PathParams const& p, First const& first, Second const& second, PayoffSums* blocks) {
+  for (int b = first_block; b < last_block; b++) {
+    state.seed(state.base_seed, static_cast<unsigned>(b));
+    blocks[b] = payoff_sums_slice<Report>(precision, state, progress, block_begin(b), block_end(num_sims, b), p, first, second);
+  }
+}
+
+// all paths of a contract on the calling thread, in seeded blocks once the state is seeded
+template <class First, class Second>
+PayoffSums serial_sums(Precision precision, WorkerState& state, int num_sims, PathParams const& p, First const& first, Second const& second) {
+  if (!state.seeded) {
+    return payoff_sums_slice<false>(precision, state, nullptr, 0, num_sims, p, first, second);
+  }
+  PairwiseSum total;
+  for (int b = 0; b < block_count(num_sims); b++) {
+    state.seed(state.base_seed, static_cast<unsigned>(b));
+    total.add(payoff_sums_slice<false>(precision, state, nullptr, block_begin(b), block_end(num_sims, b), p, first, second));
+  }
+  return total.total();
+}
+
+// discounted standard error of a payoff mean from its sum and sum of squares
+double standard_error(double sum, double sum_sq, double n, double discount) {
+  if (n < 2.0) {
+    return 0.0;
+  }
+  double mean = sum / n;
+  double variance = std::max((sum_sq - n * mean * mean) / (n - 1.0), 0.0);
+  return discount * sqrt(variance / n);
+}
+
+PricingResult make_result(Contract const& c, PathParams const& p, PayoffSums const& sums) {
+  double n = static_cast<double>(c.num_sims);
+  return PricingResult{c.num_sims, c.S, c.K, c.r, c.v, c.T, (sums.call / n) * p.discount, (sums.put / n) * p.discount,
+                       standard_error(sums.call, sums.call_sq, n, p.discount), standard_error(sums.put, sums.put_sq, n, p.discount)};
+}
+
+// every worker's share of the paths, reduced to sums over the whole contract: per worker
+// slice, or in a seeded run per block
+template <class First, class Second>
+PayoffSums run_workers(EngineContext& engine, Contract const& contract, PathParams const& params, Precision precision,
+                       First const& first, Second const& second) {
+  unsigned n = engine.pool.size();
+  bool report = engine.progress.enabled();
+  engine.progress.reset(contract.num_sims);
+
+  bool seeded = engine.workers[0].seeded;
+  int blocks = seeded ? block_count(contract.num_sims) : 0;
+  engine.scratch.reset();
+  PayoffSums* block_sums = seeded ? engine.scratch.allocate<PayoffSums>(static_cast<size_t>(blocks)) : nullptr;
+
+  engine.pool.run([&](unsigned w) {
+    PerfCounters* counters = nullptr;
+    if (engine.perf_enabled) {
+      if (!engine.perf_counters[w]) {
+        engine.perf_counters[w].reset(new PerfCounters());
+      }
+      counters = engine.perf_counters[w].get();
+      counters->start();
+    }
+
+    if (seeded) {
+      int first_block = slice_begin(blocks, w, n);
+      int last_block = slice_begin(blocks, w + 1, n);
+      if (report) {
+        block_sums_slice<true>(precision, engine.workers[w], &engine.progress, contract.num_sims, first_block, last_block,
+                               params, first, second, block_sums);
+      } else {
+        block_sums_slice<false>(precision, engine.workers[w], nullptr, contract.num_sims, first_block, last_block,
+                                params, first, second, block_sums);
+      }
+      if (counters) {
+        engine.perf[w] = counters->stop();
+      }
+      return;
+    }
+
+    int begin = slice_begin(contract.num_sims, w, n);
+    int end = slice_begin(contract.num_sims, w + 1, n);
+    PayoffSums sums = report
+      ? payoff_sums_slice<true>(precision, engine.workers[w], &engine.progress, begin, end, params, first, second)
+      : payoff_sums_slice<false>(precision, engine.workers[w], nullptr, begin, end, params, first, second);
+
+    if (counters) {
+      engine.perf[w] = counters->stop();
+    }
+    engine.call_sums[w] = sums.call;
+    engine.put_sums[w] = sums.put;
+    engine.call_sq_sums[w] = sums.call_sq;
+    engine.put_sq_sums[w] = sums.put_sq;
+  });
+
+  if (seeded) {
+    ScopedTimer timer(PHASE_REDUCTION, static_cast<uint64_t>(blocks));
+    return pairwise_sum(block_sums, static_cast<size_t>(blocks), 1);
+  }
+  int workers = static_cast<int>(n);
+  ScopedTimer timer(PHASE_REDUCTION, n);
+  return PayoffSums{sum(engine.call_sums.data(), workers), sum(engine.put_sums.data(), workers),
+                    sum(engine.call_sq_sums.data(), workers), sum(engine.put_sq_sums.data(), workers)};
+}
+
+// the product's price from sums where it is the first payoff
+PayoffPrice payoff_price(Contract const& c, PathParams const& p, PayoffSums const& sums) {
+  double n = static_cast<double>(c.num_sims);
+  return PayoffPrice{(sums.call / n) * p.discount, standard_error(sums.call, sums.call_sq, n, p.discount)};
+}
+
+}
+
+namespace {
+
+// std::seed_seq over (seed low, seed high, stream), generating the same words, but without
+// the std::vector seed_seq keeps its values in: seeded runs restart a stream every block.
+class StreamSeed {
+  private:
+    uint32_t _values[3];
+
+    static uint32_t mix(uint32_t x) {
+      return x ^ (x >> 27);
+    }
+
+  public:
+    typedef uint32_t result_type;
+
+    StreamSeed(unsigned long long seed, unsigned stream)
+      : _values{static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32), static_cast<uint32_t>(stream)} {}
+
+    // the generate() of [rand.util.seedseq]
+    template <class It>
+    void generate(It begin, It end) const {
+      const size_t n = static_cast<size_t>(end - begin);
+      if (n == 0) {
+        return;
+      }
+      const size_t s = 3;
+      const size_t t = n >= 623 ? 11 : n >= 68 ? 7 : n >= 39 ? 5 : n >= 7 ? 3 : (n - 1) / 2;
+      const size_t p = (n - t) / 2;
+      const size_t q = p + t;
+      const size_t m = std::max(s + 1, n);
+      std::fill(begin, end, 0x8b8b8b8bu);
+      for (size_t k = 0; k < m; k++) {
+        uint32_t r1 = 1664525u * mix(static_cast<uint32_t>(begin[k % n] ^ begin[(k + p) % n] ^ begin[(k + n - 1) % n]));
+        uint32_t r2 = r1 + static_cast<uint32_t>(k == 0 ? s : k <= s ? k % n + _values[k - 1] : k % n);
+        begin[(k + p) % n] = static_cast<uint32_t>(begin[(k + p) % n] + r1);
+        begin[(k + q) % n] = static_cast<uint32_t>(begin[(k + q) % n] + r2);
+        begin[k % n] = r2;
+      }
+      for (size_t k = m; k < m + n; k++) {
+        uint32_t r3 = 1566083941u * mix(static_cast<uint32_t>(begin[k % n] + begin[(k + p) % n] + begin[(k + n - 1) % n]));
+        uint32_t r4 = r3 - static_cast<uint32_t>(k % n);
+        begin[(k + p) % n] = static_cast<uint32_t>(begin[(k + p) % n] ^ r3);
+        begin[(k + q) % n] = static_cast<uint32_t>(begin[(k + q) % n] ^ r4);
+        begin[k % n] = r4;
+      }
+    }
+};
+
+}
+
+void WorkerState::seed(unsigned long long seed, unsigned stream) {
+  StreamSeed seq(seed, stream);
+  gen.seed(seq);
+  distribution.reset();
+  distribution_f.reset();
+  seeded = true;
+  base_seed = seed;
+}
+
+EngineContext::EngineContext(unsigned num_workers, long progress_interval, ProgressReporter::Callback progress_callback)
+  : pool(num_workers), progress(progress_interval, std::move(progress_callback)),
+    call_sums(num_workers, 0.0), put_sums(num_workers, 0.0), call_sq_sums(num_workers, 0.0), put_sq_sums(num_workers, 0.0) {
+  std::random_device rd;
+  workers.reserve(num_workers);
+  for (unsigned w = 0; w < num_workers; w++) {
+    workers.emplace_back(rd());
+  }
+}
+
+void EngineContext::seed(unsigned long long seed) {
+  for (unsigned w = 0; w < workers.size(); w++) {
+    workers[w].seed(seed, w);
+  }
+}
+
+void EngineContext::unseed() {
+  for (WorkerState& worker : workers) {
+    worker.unseed();
+  }
+}
+
+bool EngineContext::pin_workers() {
+  if (!pool.pin_workers()) {
+    return false;
+  }
+  if (numa_node_count() > 1) {
+    for (unsigned w = 0; w < workers.size(); w++) {
+      workers[w].arena.bind(cpu_numa_node(pool.worker_cpu(w)));
+    }
+    scratch.bind(cpu_numa_node(pool.worker_cpu(0)));
+  }
+  return true;
+}
+
+void EngineContext::enable_perf_counters() {
+  perf_enabled = true;
+  perf_counters.resize(workers.size());
+  perf.resize(workers.size());
+}
+
+PerfSample EngineContext::perf_total() const {
+  PerfSample total;
+  for (PerfSample const& sample : perf) {
+    total += sample;
+  }
+  return total;
+}
+
+PricingResult price(EngineContext& engine, Contract const& contract, Precision precision) {
+  PathParams params(contract);
+  return make_result(contract, params, run_workers(engine, contract, params, precision, CallPayoff(contract.K), PutPayoff(contract.K)));
+}
+
+PricingResult price_serial(WorkerState& state, Contract const& contract, Precision precision) {
+  PathParams params(contract);
+  return make_result(contract, params, serial_sums(precision, state, contract.num_sims, params, CallPayoff(contract.K), PutPayoff(contract.K)));
+}
+
+void price_shared(EngineContext& engine, Contract const* contracts, size_t count, PricingResult* results, Precision precision) {
+  if (count == 0) {
+    return;
+  }
+  int num_sims = contracts[0].num_sims;
+  engine.scratch.reset();
+  PathParams* params = engine.scratch.allocate<PathParams>(count);
+  for (size_t c = 0; c < count; c++) {
+    new (&params[c]) PathParams(contracts[c]);
+  }
+
+  // per-worker sums, or in a seeded run per-block sums, contract by contract
+  unsigned n = engine.pool.size();
+  bool seeded = engine.workers[0].seeded;
+  int blocks = seeded ? block_count(num_sims) : 0;
+  size_t parts = seeded ? static_cast<size_t>(blocks) : n;
+  PayoffSums* sums = engine.scratch.allocate<PayoffSums>(parts * count);
+  std::fill(sums, sums + parts * count, PayoffSums{0.0, 0.0, 0.0, 0.0});
+  engine.pool.run([&](unsigned w) {
+    PerfCounters* counters = nullptr;
+    if (engine.perf_enabled) {
+      if (!engine.perf_counters[w]) {
+        engine.perf_counters[w].reset(new PerfCounters());
+      }
+      counters = engine.perf_counters[w].get();
+      counters->start();
+    }
+
+    WorkerState& state = engine.workers[w];
+    if (seeded) {
+      for (int b = slice_begin(blocks, w, n); b < slice_begin(blocks, w + 1, n); b++) {
+        state.seed(state.base_seed, static_cast<unsigned>(b));
+        shared_sums_slice(precision, state, block_begin(b), block_end(num_sims, b), params, count, &sums[static_cast<size_t>(b) * count]);
+      }
+    } else {
+      shared_sums_slice(precision, state, slice_begin(num_sims, w, n), slice_begin(num_sims, w + 1, n),
+                        params, count, &sums[w * count]);
+    }
+
+    if (counters) {
+      engine.perf[w] = counters->stop();
+    }
+  });
+
+  ScopedTimer timer(PHASE_REDUCTION, parts * count);
+  for (size_t c = 0; c < count; c++) {
+    results[c] = make_result(contracts[c], params[c], pairwise_sum(&sums[c], parts, count));
+  }
+}
+
+template <class Payoff>
+PayoffPrice price_payoff(EngineContext& engine, Contract const& contract, Payoff const& payoff, Precision precision) {
+  PathParams params(contract);
+  return payoff_price(contract, params, run_workers(engine, contract, params, precision, payoff, NoPayoff()));
+}
+
+template <class Payoff>
+PayoffPrice price_payoff_serial(WorkerState& state, Contract const& contract, Payoff const& payoff, Precision precision) {
+  PathParams params(contract);
+  return payoff_price(contract, params, serial_sums(precision, state, contract.num_sims, params, payoff, NoPayoff()));
+}
+
+#define MC_INSTANTIATE_PRICE_PAYOFF(Payoff) \
+  template PayoffPrice price_payoff<Payoff>(EngineContext&, Contract const&, Payoff const&, Precision); \
+  template PayoffPrice price_payoff_serial<Payoff>(WorkerState&, Contract const&, Payoff const&, Precision);
+MC_FOR_EACH_PRODUCT(MC_INSTANTIATE_PRICE_PAYOFF)
+#undef MC_INSTANTIATE_PRICE_PAYOFF
+
+}
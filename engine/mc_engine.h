@@ -0,0 +1,210 @@
+#ifndef MC_ENGINE_H
+#define MC_ENGINE_H
+
+// Monte Carlo pricing engine for European vanilla options under Black-Scholes dynamics.
+//
+// This is the one kernel behind the sim CLI, the Lambda function and the benchmarks. Call
+// and put are priced together from the same simulated terminal prices: normals are drawn a
+// chunk at a time into a per-worker buffer, then a branch-free loop evolves them to S(T)
+// and accumulates both payoffs. Other terminal payoffs (engine/payoffs.h) are priced the
+// same way by price_payoff(), each with its own specialised kernel.
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "engine/arena.h"
+#include "engine/cpu_features.h"
+#include "engine/metrics.h"
+#include "engine/payoffs.h"
+#include "engine/perf_counters.h"
+#include "engine/worker_pool.h"
+
+namespace mc {
+
+// paths per RNG refill / progress report; 2048 normals keep the chunk buffer in L1
+static const int PATH_CHUNK = 2048;
+
+// Paths per block of a seeded run. Seeded runs draw every block from its own stream,
+// restarted from (seed, block index), and add the block sums up in a fixed pairwise tree,
+// so which worker prices a block changes nothing: a seeded price is the same bit for bit
+// on any number of workers, from price_serial() and from a price_shared() batch, at the
+// same kernel level. 8 chunks keep the cost of restarting a stream near 2%.
+static const int SEEDED_BLOCK = 8 * PATH_CHUNK;
+
+// What paths are simulated in and how payoffs are accumulated. Float paths draw float
+// normals and evaluate exp in float, twice the SIMD width of double.
+enum class Precision : uint8_t {
+  Double,      // double paths, double sums
+  Float,       // float paths, payoffs summed in double
+  FloatKahan   // float paths, payoffs summed in float with Kahan compensation per chunk
+};
+
+// "double", "float" or "float-kahan"
+const char* precision_name(Precision precision);
+bool precision_from_string(std::string const& name, Precision& precision);
+
+struct Contract {
+  int num_sims;  // no of simulated asset paths
+  double S;      // underlying price
+  double K;      // strike price
+  double r;      // risk-free rate
+  double v;      // volatility of the underlying
+  double T;      // years until expiry
+};
+
+struct PricingResult {
+  int num_sims;
+  double S;
+  double K;
+  double r;
+  double v;
+  double T;
+  double call;
+  double put;
+  double call_stderr;  // standard error of the discounted call estimate
+  double put_stderr;
+};
+
+// discounted price of a single product and the standard error of the estimate
+struct PayoffPrice {
+  double price;
+  double standard_error;
+};
+
+// Chunk-level progress for the pricing loops. Workers call on_chunk() between chunks of
+// paths, never from the per-path kernel; the callback fires each time the shared path
+// count crosses a multiple of the interval. An interval of 0 disables reporting, and the
+// pricing loop then compiles without the hook at all.
+class ProgressReporter {
+  public:
+    typedef std::function<void(long done, long total)> Callback;
+
+  private:
+    long _interval;
+    Callback _callback;
+    std::atomic<long> _done{0};
+    long _total = 0;
+
+  public:
+    ProgressReporter(long interval, Callback callback)
+      : _interval(interval), _callback(std::move(callback)) {}
+
+    bool enabled() const {
+      return _interval > 0 && _callback;
+    }
+
+    void reset(long total) {
+      _done.store(0, std::memory_order_relaxed);
+      _total = total;
+    }
+
+    void on_chunk(long paths) {
+      long before = _done.fetch_add(paths, std::memory_order_relaxed);
+      long after = before + paths;
+      if (after / _interval != before / _interval) {
+        _callback(after, _total);
+      }
+    }
+};
+
+// A pricing worker's private state: its RNG stream and its scratch arena. The chunk
+// buffers of the current job are carved from the arena when the job starts, only those
+// its precision needs; the arena is reset by the next job.
+struct WorkerState {
+  std::mt19937 gen;
+  std::normal_distribution<double> distribution{0.0, 1.0};
+  std::normal_distribution<float> distribution_f{0.0f, 1.0f};
+  Arena arena;
+  double* gauss = nullptr;
+  float* gauss_f = nullptr;
+  float* terminal_f = nullptr;  // S(T) of a chunk, for the two-pass Kahan kernel
+  bool seeded = false;  // price in seeded blocks, see SEEDED_BLOCK
+  unsigned long long base_seed = 0;
+
+  explicit WorkerState(std::mt19937::result_type seed) : gen(seed) {}
+
+  // Restarts the stream from (seed, stream), so it is reproducible, and makes the
+  // following runs seeded ones.
+  void seed(unsigned long long seed, unsigned stream);
+
+  // Goes back to drawing from the stream as it is, for estimates that need not repeat.
+  void unseed() {
+    seeded = false;
+  }
+};
+
+// Everything a multi-threaded pricing run needs that should outlive a single run: the
+// worker pool, the progress reporter, one RNG stream and arena per worker, an arena for
+// the calling thread's per-run data and the per-worker partial sums (of payoffs and
+// squared payoffs). Create it once and reuse it: after the first runs of each size, a run
+// allocates no memory.
+class EngineContext {
+  public:
+    WorkerPool pool;
+    ProgressReporter progress;
+    std::vector<WorkerState> workers;
+    Arena scratch;
+    std::vector<double> call_sums;
+    std::vector<double> put_sums;
+    std::vector<double> call_sq_sums;
+    std::vector<double> put_sq_sums;
+
+    // hardware counters per worker, opened on the worker's own thread on first use, and
+    // what each worker counted during the last run; see enable_perf_counters()
+    bool perf_enabled = false;
+    std::vector<std::unique_ptr<PerfCounters>> perf_counters;
+    std::vector<PerfSample> perf;
+
+    explicit EngineContext(unsigned num_workers, long progress_interval = 0, ProgressReporter::Callback progress_callback = nullptr);
+
+    // Seeds the following runs, so a contract prices identically on any context whatever
+    // its worker count; see SEEDED_BLOCK.
+    void seed(unsigned long long seed);
+
+    // Ends seeded pricing: runs draw from the worker streams where they stand.
+    void unseed();
+
+    // Pins the workers to CPUs (WorkerPool::pin_workers) and, with more than one NUMA
+    // node, binds each worker's arena to its CPU's node, and the scratch arena to the
+    // calling thread's, so every path buffer is local to the core that fills it. False if
+    // the workers could not be pinned.
+    bool pin_workers();
+
+    // Counts hardware events around each worker's share of every following run. Worker 0
+    // is the calling thread, so keep calling price() from the same thread.
+    void enable_perf_counters();
+
+    // the last run's counters summed over all workers
+    PerfSample perf_total() const;
+};
+
+// Prices a contract with its paths split over every worker of the context.
+PricingResult price(EngineContext& engine, Contract const& contract, Precision precision = Precision::Double);
+
+// Prices a contract on the calling thread with the given worker state; once the state is
+// seeded, to the same result as price() seeded alike.
+PricingResult price_serial(WorkerState& state, Contract const& contract, Precision precision = Precision::Double);
+
+// Prices contracts with the same num_sims from one set of paths: each chunk of normals is
+// drawn once, on the workers' slices as in price(), and evolved for every contract in turn
+// (common random numbers). Drawing the normals is most of the cost of a contract, so a
+// batch of n costs much less than n calls to price(). Every price is as accurate as on its
+// own, but the errors of the batch are correlated. results must have room for count.
+void price_shared(EngineContext& engine, Contract const* contracts, size_t count, PricingResult* results, Precision precision = Precision::Double);
+
+// Price a product of engine/payoffs.h; the contract's strike is ignored in favour of the
+// payoff's own. Instantiated for every type in MC_FOR_EACH_PRODUCT.
+template <class Payoff>
+PayoffPrice price_payoff(EngineContext& engine, Contract const& contract, Payoff const& payoff, Precision precision = Precision::Double);
+
+template <class Payoff>
+PayoffPrice price_payoff_serial(WorkerState& state, Contract const& contract, Payoff const& payoff, Precision precision = Precision::Double);
+
+}
+
+#endif
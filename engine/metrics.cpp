@@ -0,0 +1,214 @@
+#include "engine/metrics.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace mc {
+
+namespace {
+
+const char* const PHASE_NAMES[PHASE_COUNT] = { "rng", "path", "payoff", "reduction", "serialise", "upload" };
+const char* const PHASE_UNITS[PHASE_COUNT] = { "normals", "paths", "paths", "partials", "rows", "bytes" };
+
+// Written only by its owning thread, with relaxed load+store instead of read-modify-write;
+// the padding keeps slots of different threads off each other's cache lines.
+struct ThreadMetrics {
+  std::atomic<uint64_t> ns[PHASE_COUNT];
+  std::atomic<uint64_t> calls[PHASE_COUNT];
+  std::atomic<uint64_t> items[PHASE_COUNT];
+  char padding[64];
+
+  ThreadMetrics() {
+    for (int p = 0; p < PHASE_COUNT; p++) {
+      ns[p].store(0, std::memory_order_relaxed);
+      calls[p].store(0, std::memory_order_relaxed);
+      items[p].store(0, std::memory_order_relaxed);
+    }
+  }
+};
+
+std::atomic<bool> enabled_flag{false};
+
+// Slots are never freed, so counts of finished threads stay in the totals; the registry
+// itself is leaked so it outlives threads still recording during static destruction.
+std::mutex& registry_mutex() {
+  static std::mutex* mutex = new std::mutex();
+  return *mutex;
+}
+
+std::vector<ThreadMetrics*>& registry() {
+  static std::vector<ThreadMetrics*>* slots = new std::vector<ThreadMetrics*>();
+  return *slots;
+}
+
+ThreadMetrics& thread_slot() {
+  static thread_local ThreadMetrics* slot = nullptr;
+  if (!slot) {
+    slot = new ThreadMetrics();
+    std::lock_guard<std::mutex> lock(registry_mutex());
+    registry().push_back(slot);
+  }
+  return *slot;
+}
+
+void bump(std::atomic<uint64_t>& counter, uint64_t delta) {
+  counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+double seconds(uint64_t ns) {
+  return static_cast<double>(ns) * 1e-9;
+}
+
+// a unique temp file renamed over path, so a scraper never reads a partial file and two
+// processes writing the same path do not write into each other's temp file
+bool write_file(std::string const& path, std::string const& content) {
+  std::string tmp = path + ".XXXXXX";
+  int fd = mkstemp(&tmp[0]);
+  if (fd < 0) {
+    return false;
+  }
+  // mkstemp creates the file 0600; the scraper may run as another user
+  fchmod(fd, 0644);
+  FILE* f = fdopen(fd, "wb");
+  if (!f) {
+    close(fd);
+    remove(tmp.c_str());
+    return false;
+  }
+  bool ok = fwrite(content.data(), 1, content.size(), f) == content.size();
+  ok = fclose(f) == 0 && ok;
+  if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+    remove(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+}
+
+const char* phase_name(int phase) {
+  return PHASE_NAMES[phase];
+}
+
+MetricsSnapshot MetricsSnapshot::operator-(MetricsSnapshot const& earlier) const {
+  MetricsSnapshot diff;
+  for (int p = 0; p < PHASE_COUNT; p++) {
+    diff.ns[p] = ns[p] - earlier.ns[p];
+    diff.calls[p] = calls[p] - earlier.calls[p];
+    diff.items[p] = items[p] - earlier.items[p];
+  }
+  return diff;
+}
+
+void set_metrics_enabled(bool enabled) {
+  enabled_flag.store(enabled, std::memory_order_relaxed);
+}
+
+bool metrics_enabled() {
+  return enabled_flag.load(std::memory_order_relaxed);
+}
+
+bool metrics_from_env() {
+  const char* env = std::getenv("METRICS");
+  return env && std::atoi(env) > 0;
+}
+
+void metrics_add(Phase phase, uint64_t ns, uint64_t items) {
+  ThreadMetrics& slot = thread_slot();
+  bump(slot.ns[phase], ns);
+  bump(slot.calls[phase], 1);
+  bump(slot.items[phase], items);
+}
+
+MetricsSnapshot metrics_snapshot() {
+  MetricsSnapshot total;
+  std::lock_guard<std::mutex> lock(registry_mutex());
+  for (ThreadMetrics const* slot : registry()) {
+    for (int p = 0; p < PHASE_COUNT; p++) {
+      total.ns[p] += slot->ns[p].load(std::memory_order_relaxed);
+      total.calls[p] += slot->calls[p].load(std::memory_order_relaxed);
+      total.items[p] += slot->items[p].load(std::memory_order_relaxed);
+    }
+  }
+  return total;
+}
+
+std::string metrics_summary(MetricsSnapshot const& m, double wall_seconds) {
+  char line[160];
+  std::string out;
+  snprintf(line, sizeof(line), "%-10s %12s %8s %12s %16s\n", "phase", "time (ms)", "share", "calls", "throughput");
+  out += line;
+  for (int p = 0; p < PHASE_COUNT; p++) {
+    if (m.calls[p] == 0) {
+      continue;
+    }
+    double s = seconds(m.ns[p]);
+    double share = wall_seconds > 0.0 ? 100.0 * s / wall_seconds : 0.0;
+    double rate = s > 0.0 ? static_cast<double>(m.items[p]) / s : 0.0;
+    snprintf(line, sizeof(line), "%-10s %12.3f %7.1f%% %12llu %10.4g %s/s\n", PHASE_NAMES[p], s * 1e3, share,
+             static_cast<unsigned long long>(m.calls[p]), rate, PHASE_UNITS[p]);
+    out += line;
+  }
+  snprintf(line, sizeof(line), "%-10s %12.3f\n", "wall", wall_seconds * 1e3);
+  out += line;
+  return out;
+}
+
+std::string metrics_json(MetricsSnapshot const& m, double wall_seconds) {
+  char buf[256];
+  snprintf(buf, sizeof(buf), "{\"wall_ms\": %.3f, \"phases\": {", wall_seconds * 1e3);
+  std::string out = buf;
+  for (int p = 0; p < PHASE_COUNT; p++) {
+    snprintf(buf, sizeof(buf), "%s\"%s\": {\"ms\": %.3f, \"calls\": %llu, \"%s\": %llu}", p ? ", " : "", PHASE_NAMES[p],
+             seconds(m.ns[p]) * 1e3, static_cast<unsigned long long>(m.calls[p]), PHASE_UNITS[p],
+             static_cast<unsigned long long>(m.items[p]));
+    out += buf;
+  }
+  out += "}}\n";
+  return out;
+}
+
+std::string metrics_prometheus(MetricsSnapshot const& m) {
+  char buf[160];
+  std::string out;
+  out += "# HELP mc_phase_seconds_total Time spent in each pricing phase, summed over threads.\n";
+  out += "# TYPE mc_phase_seconds_total counter\n";
+  for (int p = 0; p < PHASE_COUNT; p++) {
+    snprintf(buf, sizeof(buf), "mc_phase_seconds_total{phase=\"%s\"} %.9f\n", PHASE_NAMES[p], seconds(m.ns[p]));
+    out += buf;
+  }
+  out += "# HELP mc_phase_calls_total Timed sections per pricing phase.\n";
+  out += "# TYPE mc_phase_calls_total counter\n";
+  for (int p = 0; p < PHASE_COUNT; p++) {
+    snprintf(buf, sizeof(buf), "mc_phase_calls_total{phase=\"%s\"} %llu\n", PHASE_NAMES[p], static_cast<unsigned long long>(m.calls[p]));
+    out += buf;
+  }
+  out += "# HELP mc_phase_items_total Items processed per pricing phase (normals, paths, rows or bytes).\n";
+  out += "# TYPE mc_phase_items_total counter\n";
+  for (int p = 0; p < PHASE_COUNT; p++) {
+    snprintf(buf, sizeof(buf), "mc_phase_items_total{phase=\"%s\",unit=\"%s\"} %llu\n", PHASE_NAMES[p], PHASE_UNITS[p],
+             static_cast<unsigned long long>(m.items[p]));
+    out += buf;
+  }
+  return out;
+}
+
+bool export_metrics_files(MetricsSnapshot const& run, MetricsSnapshot const& total, double wall_seconds) {
+  bool ok = true;
+  const char* json_path = std::getenv("METRICS_JSON");
+  if (json_path && *json_path) {
+    ok = write_file(json_path, metrics_json(run, wall_seconds)) && ok;
+  }
+  const char* prom_path = std::getenv("METRICS_PROM");
+  if (prom_path && *prom_path) {
+    ok = write_file(prom_path, metrics_prometheus(total)) && ok;
+  }
+  return ok;
+}
+
+}
@@ -0,0 +1,95 @@
+#ifndef MC_METRICS_H
+#define MC_METRICS_H
+
+// Per-phase timing and throughput for pricing runs and the drivers around them.
+//
+// A ScopedTimer adds its lifetime, and optionally the number of items it processed, to the
+// calling thread's counters for one phase. Each thread gets its own slot on first use, so
+// recording is two clock reads and a few uncontended stores; readers sum over the slots.
+// Times come from steady_clock, which on x86 Linux is the TSC read through the vDSO.
+//
+// Collection is off until set_metrics_enabled(true), METRICS=1 in the drivers; a timer
+// created while it is off does not read the clock at all.
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace mc {
+
+enum Phase {
+  PHASE_RNG,        // normal generation, items are normals
+  PHASE_PATH,       // evolution to S(T), with the payoffs of fused kernels, items are paths
+  PHASE_PAYOFF,     // payoff accumulation in a pass of its own (float-kahan), items are paths
+  PHASE_REDUCTION,  // combining per-worker sums, items are partial sums
+  PHASE_SERIALISE,  // encoding results, items are rows
+  PHASE_UPLOAD,     // S3 requests, items are bytes sent
+  PHASE_COUNT
+};
+
+const char* phase_name(int phase);
+
+// Counter totals over all threads, either since start-up or, as a difference of two
+// snapshots, over one run.
+struct MetricsSnapshot {
+  uint64_t ns[PHASE_COUNT] = {};
+  uint64_t calls[PHASE_COUNT] = {};
+  uint64_t items[PHASE_COUNT] = {};
+
+  MetricsSnapshot operator-(MetricsSnapshot const& earlier) const;
+};
+
+void set_metrics_enabled(bool enabled);
+bool metrics_enabled();
+
+// METRICS=1 asks the drivers to collect metrics.
+bool metrics_from_env();
+
+// Adds to the calling thread's counters for phase.
+void metrics_add(Phase phase, uint64_t ns, uint64_t items);
+
+MetricsSnapshot metrics_snapshot();
+
+class ScopedTimer {
+  private:
+    Phase _phase;
+    uint64_t _items;
+    bool _active;
+    std::chrono::steady_clock::time_point _start;
+
+  public:
+    explicit ScopedTimer(Phase phase, uint64_t items = 0)
+      : _phase(phase), _items(items), _active(metrics_enabled()) {
+      if (_active) {
+        _start = std::chrono::steady_clock::now();
+      }
+    }
+
+    ~ScopedTimer() {
+      if (_active) {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _start).count();
+        metrics_add(_phase, static_cast<uint64_t>(ns), _items);
+      }
+    }
+
+    ScopedTimer(ScopedTimer const&) = delete;
+    ScopedTimer& operator=(ScopedTimer const&) = delete;
+};
+
+// Human-readable table: time, share of wall_seconds and throughput per phase. Phases of
+// different threads overlap, so shares can add up to more than 100%.
+std::string metrics_summary(MetricsSnapshot const& m, double wall_seconds);
+
+// One JSON object with the same figures.
+std::string metrics_json(MetricsSnapshot const& m, double wall_seconds);
+
+// Prometheus text exposition format; pass cumulative totals, as Prometheus counters expect.
+std::string metrics_prometheus(MetricsSnapshot const& m);
+
+// Writes METRICS_JSON (the run) and METRICS_PROM (the cumulative totals) when those
+// variables name a file; each file is replaced atomically. False if a write failed.
+bool export_metrics_files(MetricsSnapshot const& run, MetricsSnapshot const& total, double wall_seconds);
+
+}
+
+#endif
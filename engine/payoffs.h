@@ -0,0 +1,133 @@
+#ifndef MC_PAYOFFS_H
+#define MC_PAYOFFS_H
+
+// Payoff policies for the pricing kernels.
+//
+// A payoff is a small functor of the terminal price that the kernel templates inline, so
+// every product gets its own branch-free, vectorizable loop with no virtual dispatch. The
+// static constexpr flags state what a payoff needs from the path. The engine simulates
+// terminal prices only, and its kernels reject path-dependent payoffs at compile time.
+//
+// Composites (SumPayoff, DifferencePayoff) combine payoffs and their flags, which is how
+// straddles, strangles and spreads are built.
+
+#include <algorithm>
+
+namespace mc {
+
+// Flags of a payoff that only looks at S(T).
+struct TerminalPayoff {
+  static constexpr bool path_dependent = false;
+  static constexpr bool needs_average = false;  // arithmetic average of the path
+  static constexpr bool needs_max = false;      // running maximum of the path
+};
+
+struct CallPayoff : TerminalPayoff {
+  double K;
+
+  explicit CallPayoff(double strike) : K(strike) {}
+
+  template <class Real>
+  Real operator()(Real S) const {
+    return std::max(S - static_cast<Real>(K), Real(0));
+  }
+};
+
+struct PutPayoff : TerminalPayoff {
+  double K;
+
+  explicit PutPayoff(double strike) : K(strike) {}
+
+  template <class Real>
+  Real operator()(Real S) const {
+    return std::max(static_cast<Real>(K) - S, Real(0));
+  }
+};
+
+// cash-or-nothing: pays cash if S(T) ends above (call) or below (put) the strike
+struct DigitalCallPayoff : TerminalPayoff {
+  double K;
+  double cash;
+
+  DigitalCallPayoff(double strike, double payout) : K(strike), cash(payout) {}
+
+  template <class Real>
+  Real operator()(Real S) const {
+    return S > static_cast<Real>(K) ? static_cast<Real>(cash) : Real(0);
+  }
+};
+
+struct DigitalPutPayoff : TerminalPayoff {
+  double K;
+  double cash;
+
+  DigitalPutPayoff(double strike, double payout) : K(strike), cash(payout) {}
+
+  template <class Real>
+  Real operator()(Real S) const {
+    return S < static_cast<Real>(K) ? static_cast<Real>(cash) : Real(0);
+  }
+};
+
+// Pays nothing; the second leg of kernels that price a single payoff.
+struct NoPayoff : TerminalPayoff {
+  template <class Real>
+  Real operator()(Real) const {
+    return Real(0);
+  }
+};
+
+template <class A, class B>
+struct SumPayoff {
+  static constexpr bool path_dependent = A::path_dependent || B::path_dependent;
+  static constexpr bool needs_average = A::needs_average || B::needs_average;
+  static constexpr bool needs_max = A::needs_max || B::needs_max;
+
+  A a;
+  B b;
+
+  SumPayoff(A first, B second) : a(first), b(second) {}
+
+  template <class Real>
+  Real operator()(Real S) const {
+    return a(S) + b(S);
+  }
+};
+
+// long A, short B
+template <class A, class B>
+struct DifferencePayoff {
+  static constexpr bool path_dependent = A::path_dependent || B::path_dependent;
+  static constexpr bool needs_average = A::needs_average || B::needs_average;
+  static constexpr bool needs_max = A::needs_max || B::needs_max;
+
+  A a;
+  B b;
+
+  DifferencePayoff(A long_leg, B short_leg) : a(long_leg), b(short_leg) {}
+
+  template <class Real>
+  Real operator()(Real S) const {
+    return a(S) - b(S);
+  }
+};
+
+// whether a kernel that only sees S(T) can price the payoff
+template <class Payoff>
+struct is_terminal_payoff {
+  static constexpr bool value = !Payoff::path_dependent && !Payoff::needs_average && !Payoff::needs_max;
+};
+
+typedef SumPayoff<CallPayoff, PutPayoff> Straddle;          // call + put, same strike
+typedef SumPayoff<PutPayoff, CallPayoff> Strangle;          // put at K1 + call at K2 > K1
+typedef DifferencePayoff<CallPayoff, CallPayoff> CallSpread;  // long call K1, short call K2 > K1
+typedef DifferencePayoff<PutPayoff, PutPayoff> PutSpread;     // long put K2, short put K1 < K2
+
+// Every product the engine builds kernels for; X(type) is expanded once per product.
+#define MC_FOR_EACH_PRODUCT(X) \
+  X(CallPayoff) X(PutPayoff) X(DigitalCallPayoff) X(DigitalPutPayoff) \
+  X(Straddle) X(Strangle) X(CallSpread) X(PutSpread)
+
+}
+
+#endif
@@ -0,0 +1,180 @@
+#include "engine/perf_counters.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace mc {
+
+namespace {
+
+struct EventSpec {
+  const char* name;
+  uint32_t type;
+  uint64_t config;
+  bool intel_only;
+  bool kernel;  // counted in the kernel
+};
+
+// FP_ARITH_INST_RETIRED: event 0xC7, umask bits select scalar/128/256/512-bit double and single
+uint64_t fp_arith(uint64_t umask) {
+  return (umask << 8) | 0xC7;
+}
+
+uint64_t cache_event(uint64_t cache, uint64_t op, uint64_t result) {
+  return cache | (op << 8) | (result << 16);
+}
+
+const EventSpec EVENTS[PERF_EVENT_COUNT] = {
+  { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, false, false },
+  { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, false, false },
+  { "l1d_misses", PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS), false, false },
+  { "llc_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, false, false },
+  { "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, false, false },
+  { "fp_scalar", PERF_TYPE_RAW, fp_arith(0x03), true, false },
+  { "fp_128", PERF_TYPE_RAW, fp_arith(0x0C), true, false },
+  { "fp_256", PERF_TYPE_RAW, fp_arith(0x30), true, false },
+  { "fp_512", PERF_TYPE_RAW, fp_arith(0xC0), true, false },
+  { "page_faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, false, false },
+  { "cpu_migrations", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS, false, true },
+};
+
+bool is_intel_cpu() {
+  static const bool intel = [] {
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(cpuinfo, line)) {
+      if (line.compare(0, 9, "vendor_id") == 0) {
+        return line.find("GenuineIntel") != std::string::npos;
+      }
+    }
+    return false;
+  }();
+  return intel;
+}
+
+int open_event(EventSpec const& spec) {
+  perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = spec.type;
+  attr.config = spec.config;
+  attr.disabled = 1;
+  attr.exclude_kernel = spec.kernel ? 0 : 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+}
+
+const char* perf_event_name(int event) {
+  return EVENTS[event].name;
+}
+
+bool PerfSample::any() const {
+  for (int e = 0; e < PERF_EVENT_COUNT; e++) {
+    if (valid[e]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+double PerfSample::ipc() const {
+  if (!valid[PERF_CYCLES] || !valid[PERF_INSTRUCTIONS] || values[PERF_CYCLES] == 0) {
+    return 0.0;
+  }
+  return static_cast<double>(values[PERF_INSTRUCTIONS]) / static_cast<double>(values[PERF_CYCLES]);
+}
+
+PerfSample& PerfSample::operator+=(PerfSample const& other) {
+  if (other.intervals == 0) {
+    return *this;
+  }
+  if (intervals == 0) {
+    *this = other;
+    return *this;
+  }
+  for (int e = 0; e < PERF_EVENT_COUNT; e++) {
+    values[e] += other.values[e];
+    valid[e] = valid[e] && other.valid[e];
+  }
+  intervals += other.intervals;
+  return *this;
+}
+
+bool perf_counters_from_env() {
+  const char* env = std::getenv("PERF_COUNTERS");
+  return env && std::atoi(env) > 0;
+}
+
+PerfCounters::PerfCounters() {
+  bool denied = false;
+  for (int e = 0; e < PERF_EVENT_COUNT; e++) {
+    _fds[e] = -1;
+    if (denied || (EVENTS[e].intel_only && !is_intel_cpu())) {
+      continue;
+    }
+    _fds[e] = open_event(EVENTS[e]);
+    // no syscall or no permission: the remaining events would fail the same way
+    if (_fds[e] < 0 && (errno == ENOSYS || errno == EACCES || errno == EPERM)) {
+      denied = true;
+    }
+  }
+}
+
+PerfCounters::~PerfCounters() {
+  for (int fd : _fds) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+}
+
+bool PerfCounters::available() const {
+  for (int fd : _fds) {
+    if (fd >= 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void PerfCounters::start() {
+  for (int fd : _fds) {
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+}
+
+PerfSample PerfCounters::stop() {
+  for (int fd : _fds) {
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+  }
+
+  PerfSample sample;
+  sample.intervals = 1;
+  for (int e = 0; e < PERF_EVENT_COUNT; e++) {
+    uint64_t data[3];  // value, time enabled, time running
+    if (_fds[e] < 0 || read(_fds[e], data, sizeof(data)) != static_cast<ssize_t>(sizeof(data)) || data[2] == 0) {
+      continue;
+    }
+    double scale = data[2] < data[1] ? static_cast<double>(data[1]) / static_cast<double>(data[2]) : 1.0;
+    sample.values[e] = static_cast<uint64_t>(static_cast<double>(data[0]) * scale);
+    sample.valid[e] = true;
+  }
+  return sample;
+}
+
+}
@@ -0,0 +1,78 @@
+#ifndef MC_PERF_COUNTERS_H
+#define MC_PERF_COUNTERS_H
+
+// Hardware performance counters of the calling thread, via perf_event_open(2).
+//
+// Counting is best effort. Where the syscall is missing or not permitted (containers,
+// perf_event_paranoid, VMs without a virtual PMU), or an event does not exist on this CPU,
+// that counter is marked unavailable and everything else carries on. Only user space is
+// counted, which is what perf_event_paranoid=2 still allows for one's own threads; the
+// exception is CPU migrations, a scheduler event that only exists on the kernel side and
+// so needs perf_event_paranoid<=1 or CAP_PERFMON.
+//
+// The vector instruction mix comes from Intel's FP_ARITH_INST_RETIRED raw events, so it is
+// only counted on Intel CPUs.
+
+#include <cstdint>
+
+namespace mc {
+
+enum PerfEvent {
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_L1D_MISSES,
+  PERF_LLC_MISSES,
+  PERF_BRANCH_MISSES,
+  PERF_FP_SCALAR,  // scalar FP instructions retired
+  PERF_FP_128,     // 128-bit packed FP instructions retired
+  PERF_FP_256,
+  PERF_FP_512,
+  PERF_PAGE_FAULTS,     // software events: faults taken by the thread,
+  PERF_CPU_MIGRATIONS,  // and the times it was moved to another CPU
+  PERF_EVENT_COUNT
+};
+
+// Short name of an event, as used in logs and JSON.
+const char* perf_event_name(int event);
+
+// Counts over one measured interval, or the sum of several.
+struct PerfSample {
+  uint64_t values[PERF_EVENT_COUNT] = {};
+  bool valid[PERF_EVENT_COUNT] = {};
+  unsigned intervals = 0;
+
+  bool any() const;
+
+  // instructions per cycle, 0 if either is unavailable
+  double ipc() const;
+
+  // Adds another sample; a sum is only valid for events valid in every part.
+  PerfSample& operator+=(PerfSample const& other);
+};
+
+// PERF_COUNTERS=1 asks the drivers to collect counters.
+bool perf_counters_from_env();
+
+// The counters of the thread that constructs it; start() and stop() must be called on that
+// same thread. Counters that were multiplexed are scaled to the full interval.
+class PerfCounters {
+  private:
+    int _fds[PERF_EVENT_COUNT];
+
+  public:
+    PerfCounters();
+    ~PerfCounters();
+
+    PerfCounters(PerfCounters const&) = delete;
+    PerfCounters& operator=(PerfCounters const&) = delete;
+
+    // whether at least one counter could be opened
+    bool available() const;
+
+    void start();
+    PerfSample stop();
+};
+
+}
+
+#endif
@@ -0,0 +1,229 @@
+#ifndef MC_RESULT_CACHE_H
+#define MC_RESULT_CACHE_H
+
+// Content-addressed cache of pricing results.
+//
+// A key is a 128-bit hash of the canonical encoding of everything that determines a seeded
+// price: the engine tag, path count, contract and model parameters, the RNG seed, the
+// precision and the kernel level, whose vector width changes the order of the sums. Seeded
+// prices do not depend on the worker count (see SEEDED_BLOCK) or on whether metrics are
+// collected, so containers of any size share entries. Only seeded contracts are cacheable;
+// without a seed the same inputs are meant to give a fresh estimate.
+//
+// Lookups go to an in-process LRU first and then, if a directory is configured, to one small
+// file per key, so results survive container recycling when the directory is on shared
+// storage.
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+
+#include "engine/cpu_features.h"
+#include "engine/result_format.h"
+
+namespace mc {
+
+// Bump whenever the kernels change in a way that changes seeded prices.
+static const char RESULT_CACHE_ENGINE_TAG[] = "euro-mt19937-block16384-v4";
+
+// doubles per on-disk entry after the path count: parameters, prices and standard errors
+static const size_t RESULT_CACHE_FIELDS = 9;
+
+struct CacheKey {
+  uint64_t hi;
+  uint64_t lo;
+
+  bool operator==(CacheKey const& other) const {
+    return hi == other.hi && lo == other.lo;
+  }
+
+  std::string hex() const {
+    char buf[33];
+    snprintf(buf, sizeof(buf), "%016llx%016llx", static_cast<unsigned long long>(hi), static_cast<unsigned long long>(lo));
+    return buf;
+  }
+};
+
+struct CacheKeyHash {
+  size_t operator()(CacheKey const& key) const {
+    return static_cast<size_t>(key.lo);
+  }
+};
+
+// splitmix64 finaliser
+inline uint64_t cache_mix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+// Two independently seeded 64-bit lanes over the canonical little-endian encoding.
+inline CacheKey cache_hash(std::string const& canonical) {
+  uint64_t h1 = 0x6a09e667f3bcc908ULL ^ canonical.size();
+  uint64_t h2 = 0xbb67ae8584caa73bULL ^ canonical.size();
+  for (size_t i = 0; i < canonical.size(); i += 8) {
+    size_t n = canonical.size() - i < 8 ? canonical.size() - i : 8;
+    uint64_t word = get_le(canonical.data() + i, n);
+    h1 = cache_mix(h1 ^ word) + 0x9e3779b97f4a7c15ULL;
+    h2 = cache_mix(h2 + word) ^ 0xc2b2ae3d27d4eb4fULL;
+  }
+  return CacheKey{cache_mix(h1 ^ h2), cache_mix(h2 + h1)};
+}
+
+// Canonical key for a seeded contract; returns false for inputs that must not be cached.
+inline bool pricing_cache_key(int num_sims, double S, double K, double r, double v, double T,
+                              unsigned long long seed, Precision precision, CacheKey& key) {
+  const double params[] = { S, K, r, v, T };
+  std::string canonical(RESULT_CACHE_ENGINE_TAG);
+  canonical.push_back('\0');
+  pad_to_8(canonical);
+  put_le(canonical, static_cast<uint64_t>(static_cast<int64_t>(num_sims)), 8);
+  for (double param : params) {
+    if (std::isnan(param)) {
+      return false;
+    }
+    put_le(canonical, double_bits(param == 0.0 ? 0.0 : param), 8);  // -0.0 and 0.0 are one key
+  }
+  put_le(canonical, seed, 8);
+  put_le(canonical, static_cast<uint64_t>(precision), 8);
+  put_le(canonical, static_cast<uint64_t>(active_isa()), 8);
+  key = cache_hash(canonical);
+  return true;
+}
+
+// Not thread-safe; owned by the thread that serves requests.
+class ResultCache {
+  private:
+    typedef std::list<std::pair<CacheKey, PricingResult>> LruList;
+
+    size_t _capacity;
+    std::string _dir;
+    LruList _lru;
+    std::unordered_map<CacheKey, LruList::iterator, CacheKeyHash> _index;
+    unsigned long _hits = 0;
+    unsigned long _misses = 0;
+
+    std::string path_for(CacheKey const& key) const {
+      return _dir + "/" + key.hex() + ".mcc";
+    }
+
+    void remember(CacheKey const& key, PricingResult const& result) {
+      if (_capacity == 0) {
+        return;
+      }
+      auto it = _index.find(key);
+      if (it != _index.end()) {
+        it->second->second = result;
+        _lru.splice(_lru.begin(), _lru, it->second);
+        return;
+      }
+      _lru.emplace_front(key, result);
+      _index[key] = _lru.begin();
+      if (_lru.size() > _capacity) {
+        _index.erase(_lru.back().first);
+        _lru.pop_back();
+      }
+    }
+
+    bool load(CacheKey const& key, PricingResult& result) const {
+      FILE* f = fopen(path_for(key).c_str(), "rb");
+      if (!f) {
+        return false;
+      }
+      char buf[8 * (RESULT_CACHE_FIELDS + 1)];
+      bool ok = fread(buf, 1, sizeof(buf), f) == sizeof(buf);
+      fclose(f);
+      if (!ok) {
+        return false;
+      }
+      result.num_sims = static_cast<int>(static_cast<int64_t>(get_le(buf, 8)));
+      double* const fields[RESULT_CACHE_FIELDS] = { &result.S, &result.K, &result.r, &result.v, &result.T,
+                                                    &result.call, &result.put, &result.call_stderr, &result.put_stderr };
+      for (size_t i = 0; i < RESULT_CACHE_FIELDS; i++) {
+        *fields[i] = bits_double(get_le(buf + 8 * (i + 1), 8));
+      }
+      return true;
+    }
+
+    void store(CacheKey const& key, PricingResult const& result) const {
+      std::string buf;
+      put_le(buf, static_cast<uint64_t>(static_cast<int64_t>(result.num_sims)), 8);
+      const double fields[RESULT_CACHE_FIELDS] = { result.S, result.K, result.r, result.v, result.T,
+                                                   result.call, result.put, result.call_stderr, result.put_stderr };
+      for (double field : fields) {
+        put_le(buf, double_bits(field), 8);
+      }
+
+      // write a file of our own, then rename it, so that neither readers nor another container
+      // storing the same key see a partial entry
+      std::string path = path_for(key);
+      std::string tmp = path + ".XXXXXX";
+      int fd = mkstemp(&tmp[0]);
+      if (fd < 0) {
+        return;
+      }
+      // mkstemp creates the file 0600; entries are shared with containers running as other users
+      fchmod(fd, 0644);
+      FILE* f = fdopen(fd, "wb");
+      if (!f) {
+        close(fd);
+        remove(tmp.c_str());
+        return;
+      }
+      bool ok = fwrite(buf.data(), 1, buf.size(), f) == buf.size();
+      ok = fclose(f) == 0 && ok;
+      if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        remove(tmp.c_str());
+      }
+    }
+
+  public:
+    // capacity of 0 disables the in-process tier, an empty dir the on-disk one
+    ResultCache(size_t capacity, std::string dir) : _capacity(capacity), _dir(std::move(dir)) {}
+
+    bool enabled() const {
+      return _capacity > 0 || !_dir.empty();
+    }
+
+    bool get(CacheKey const& key, PricingResult& result) {
+      auto it = _index.find(key);
+      if (it != _index.end()) {
+        _lru.splice(_lru.begin(), _lru, it->second);
+        result = it->second->second;
+        _hits++;
+        return true;
+      }
+      if (!_dir.empty() && load(key, result)) {
+        remember(key, result);
+        _hits++;
+        return true;
+      }
+      _misses++;
+      return false;
+    }
+
+    void put(CacheKey const& key, PricingResult const& result) {
+      remember(key, result);
+      if (!_dir.empty()) {
+        store(key, result);
+      }
+    }
+
+    unsigned long hits() const { return _hits; }
+    unsigned long misses() const { return _misses; }
+    size_t size() const { return _lru.size(); }
+};
+
+}
+
+#endif
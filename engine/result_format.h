@@ -0,0 +1,278 @@
+#ifndef MC_RESULT_FORMAT_H
+#define MC_RESULT_FORMAT_H
+
+// Binary columnar pricing result format (".mcr"), version 1.
+//
+// All integers and floats are little-endian, every section starts on an 8 byte boundary.
+//
+//   file header
+//     0   char[4]  magic "MCPR"
+//     4   u16      format version
+//     6   u16      column count
+//     8   u32      header size in bytes, including everything up to the first row group
+//     12  u32      flags, 0
+//     16  i64      creation time, unix milliseconds
+//     24  column descriptors, 32 bytes each: char[24] name, u8 type, u8 width, 6 bytes padding
+//     ..  u32 metadata size, then "key=value\n" run metadata, padded to 8 bytes
+//
+//   row groups, repeated until end of file
+//     0   char[4]  magic "RGRP"
+//     4   u32      reserved, 0
+//     8   u64      row count
+//     16  one column after the other, row count * width bytes each, padded to 8 bytes
+//
+// Rows are written in row groups so a result can be streamed while a batch is still being
+// priced; a loader can mmap the file and use each column in place.
+
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "engine/mc_engine.h"
+
+namespace mc {
+
+enum ResultColumnType : uint8_t {
+  RESULT_INT64 = 1,
+  RESULT_FLOAT64 = 2,
+};
+
+struct ResultColumn {
+  const char* name;
+  ResultColumnType type;
+};
+
+static const uint16_t RESULT_FORMAT_VERSION = 1;
+static const char RESULT_FILE_MAGIC[4] = { 'M', 'C', 'P', 'R' };
+static const char RESULT_GROUP_MAGIC[4] = { 'R', 'G', 'R', 'P' };
+static const size_t RESULT_COLUMN_DESC_SIZE = 32;
+static const size_t RESULT_COLUMN_NAME_SIZE = 24;
+static const size_t RESULT_GROUP_HEADER_SIZE = 16;
+
+// Column order of a PricingResult row
+static const ResultColumn RESULT_COLUMNS[] = {
+  { "num_paths", RESULT_INT64 },
+  { "underlying", RESULT_FLOAT64 },
+  { "strike", RESULT_FLOAT64 },
+  { "rate", RESULT_FLOAT64 },
+  { "volatility", RESULT_FLOAT64 },
+  { "maturity", RESULT_FLOAT64 },
+  { "call", RESULT_FLOAT64 },
+  { "put", RESULT_FLOAT64 },
+};
+static const size_t RESULT_COLUMN_COUNT = sizeof(RESULT_COLUMNS) / sizeof(RESULT_COLUMNS[0]);
+
+inline void put_le(std::string& out, uint64_t value, size_t bytes) {
+  for (size_t i = 0; i < bytes; i++) {
+    out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+  }
+}
+
+inline uint64_t get_le(const char* in, size_t bytes) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < bytes; i++) {
+    value |= static_cast<uint64_t>(static_cast<unsigned char>(in[i])) << (8 * i);
+  }
+  return value;
+}
+
+inline uint64_t double_bits(double value) {
+  uint64_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+inline double bits_double(uint64_t bits) {
+  double value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+inline void pad_to_8(std::string& out) {
+  while (out.size() % 8 != 0) {
+    out.push_back('\0');
+  }
+}
+
+// Buffers PricingResult rows column-wise and encodes them as row groups.
+class BinaryResultWriter {
+  private:
+    std::vector<std::pair<std::string, std::string>> _metadata;
+    std::vector<int64_t> _num_paths;
+    std::vector<double> _columns[RESULT_COLUMN_COUNT - 1];
+
+  public:
+    explicit BinaryResultWriter(std::vector<std::pair<std::string, std::string>> metadata)
+      : _metadata(std::move(metadata)) {}
+
+    std::string header() const {
+      std::string meta;
+      for (auto const& kv : _metadata) {
+        meta += kv.first + "=" + kv.second + "\n";
+      }
+
+      std::string out(RESULT_FILE_MAGIC, 4);
+      put_le(out, RESULT_FORMAT_VERSION, 2);
+      put_le(out, RESULT_COLUMN_COUNT, 2);
+      size_t size_at = out.size();
+      put_le(out, 0, 4);
+      put_le(out, 0, 4);
+      auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
+      put_le(out, static_cast<uint64_t>(now.count()), 8);
+
+      for (auto const& column : RESULT_COLUMNS) {
+        std::string name(column.name);
+        name.resize(RESULT_COLUMN_NAME_SIZE, '\0');
+        out += name;
+        out.push_back(static_cast<char>(column.type));
+        out.push_back(8);
+        out.append(6, '\0');
+      }
+
+      put_le(out, meta.size(), 4);
+      out += meta;
+      pad_to_8(out);
+
+      std::string header_size;
+      put_le(header_size, out.size(), 4);
+      out.replace(size_at, 4, header_size);
+      return out;
+    }
+
+    void add(PricingResult const& result) {
+      _num_paths.push_back(result.num_sims);
+      const double values[RESULT_COLUMN_COUNT - 1] = { result.S, result.K, result.r, result.v, result.T, result.call, result.put };
+      for (size_t c = 0; c < RESULT_COLUMN_COUNT - 1; c++) {
+        _columns[c].push_back(values[c]);
+      }
+    }
+
+    size_t rows() const {
+      return _num_paths.size();
+    }
+
+    // Encodes the buffered rows as one row group and clears the buffer.
+    std::string flush_row_group() {
+      std::string out(RESULT_GROUP_MAGIC, 4);
+      put_le(out, 0, 4);
+      put_le(out, _num_paths.size(), 8);
+      out.reserve(out.size() + _num_paths.size() * 8 * RESULT_COLUMN_COUNT);
+
+      for (auto value : _num_paths) {
+        put_le(out, static_cast<uint64_t>(value), 8);
+      }
+      for (auto& column : _columns) {
+        for (auto value : column) {
+          put_le(out, double_bits(value), 8);
+        }
+        column.clear();
+      }
+      _num_paths.clear();
+      return out;
+    }
+};
+
+// Read-only view of an encoded result file, typically an mmap'ed one.
+class BinaryResultReader {
+  private:
+    const char* _data;
+    size_t _size;
+    std::string _error;
+    uint16_t _version = 0;
+    int64_t _created_ms = 0;
+    std::vector<std::pair<std::string, int>> _columns;
+    std::vector<std::pair<std::string, std::string>> _metadata;
+    size_t _first_group = 0;
+
+  public:
+    struct RowGroup {
+      uint64_t rows;
+      std::vector<const char*> columns;  // column c, row i at columns[c] + 8 * i
+    };
+
+    BinaryResultReader(const char* data, size_t size) : _data(data), _size(size) {
+      if (size < 24 || std::memcmp(data, RESULT_FILE_MAGIC, 4) != 0) {
+        _error = "not a pricing result file";
+        return;
+      }
+      _version = static_cast<uint16_t>(get_le(data + 4, 2));
+      if (_version != RESULT_FORMAT_VERSION) {
+        _error = "unsupported format version " + std::to_string(_version);
+        return;
+      }
+      size_t column_count = get_le(data + 6, 2);
+      _first_group = get_le(data + 8, 4);
+      _created_ms = static_cast<int64_t>(get_le(data + 16, 8));
+
+      size_t meta_at = 24 + column_count * RESULT_COLUMN_DESC_SIZE;
+      if (_first_group > size || meta_at + 4 > _first_group) {
+        _error = "truncated header";
+        return;
+      }
+      for (size_t c = 0; c < column_count; c++) {
+        const char* desc = data + 24 + c * RESULT_COLUMN_DESC_SIZE;
+        std::string name(desc, strnlen(desc, RESULT_COLUMN_NAME_SIZE));
+        _columns.push_back(std::make_pair(name, static_cast<int>(static_cast<unsigned char>(desc[RESULT_COLUMN_NAME_SIZE]))));
+      }
+
+      size_t meta_size = get_le(data + meta_at, 4);
+      if (meta_at + 4 + meta_size > _first_group) {
+        _error = "truncated metadata";
+        return;
+      }
+      std::string meta(data + meta_at + 4, meta_size);
+      size_t pos = 0;
+      while (pos < meta.size()) {
+        size_t eol = meta.find('\n', pos);
+        if (eol == std::string::npos) {
+          eol = meta.size();
+        }
+        std::string line = meta.substr(pos, eol - pos);
+        size_t eq = line.find('=');
+        if (eq != std::string::npos) {
+          _metadata.push_back(std::make_pair(line.substr(0, eq), line.substr(eq + 1)));
+        }
+        pos = eol + 1;
+      }
+    }
+
+    bool ok() const { return _error.empty(); }
+    std::string const& error() const { return _error; }
+    uint16_t version() const { return _version; }
+    int64_t created_ms() const { return _created_ms; }
+    std::vector<std::pair<std::string, int>> const& columns() const { return _columns; }
+    std::vector<std::pair<std::string, std::string>> const& metadata() const { return _metadata; }
+
+    // Calls fn(RowGroup const&) for every row group; returns false on a malformed group.
+    template <class Fn>
+    bool for_each_row_group(Fn fn) {
+      size_t pos = _first_group;
+      while (pos < _size) {
+        if (pos + RESULT_GROUP_HEADER_SIZE > _size || std::memcmp(_data + pos, RESULT_GROUP_MAGIC, 4) != 0) {
+          _error = "bad row group at offset " + std::to_string(pos);
+          return false;
+        }
+        RowGroup group;
+        group.rows = get_le(_data + pos + 8, 8);
+        pos += RESULT_GROUP_HEADER_SIZE;
+        if (group.rows > (_size - pos) / 8 / (_columns.empty() ? 1 : _columns.size())) {
+          _error = "truncated row group at offset " + std::to_string(pos);
+          return false;
+        }
+        for (size_t c = 0; c < _columns.size(); c++) {
+          group.columns.push_back(_data + pos);
+          pos += group.rows * 8;
+        }
+        fn(static_cast<RowGroup const&>(group));
+      }
+      return true;
+    }
+};
+
+}
+
+#endif
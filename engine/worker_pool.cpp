@@ -0,0 +1,201 @@
+#include "engine/worker_pool.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+namespace mc {
+
+double cgroup_cpu_quota() {
+  // cgroup v2: "<quota> <period>" or "max <period>"
+  std::ifstream v2("/sys/fs/cgroup/cpu.max");
+  if (v2) {
+    std::string quota;
+    double period = 0.0;
+    if (v2 >> quota >> period && quota != "max" && period > 0.0) {
+      return std::atof(quota.c_str()) / period;
+    }
+    return 0.0;
+  }
+
+  // cgroup v1: quota of -1 means unlimited
+  const char* const v1_dirs[] = { "/sys/fs/cgroup/cpu", "/sys/fs/cgroup/cpu,cpuacct" };
+  for (auto dir : v1_dirs) {
+    std::ifstream quota_file(std::string(dir) + "/cpu.cfs_quota_us");
+    std::ifstream period_file(std::string(dir) + "/cpu.cfs_period_us");
+    double quota = 0.0, period = 0.0;
+    if (quota_file >> quota && period_file >> period) {
+      return (quota > 0.0 && period > 0.0) ? quota / period : 0.0;
+    }
+  }
+  return 0.0;
+}
+
+unsigned detect_available_cpus() {
+  const char* forced = std::getenv("PRICING_THREADS");
+  if (forced && std::atoi(forced) > 0) {
+    return static_cast<unsigned>(std::atoi(forced));
+  }
+
+  unsigned cpus = std::thread::hardware_concurrency();
+
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  if (sched_getaffinity(0, sizeof(cpuset), &cpuset) == 0) {
+    unsigned allowed = static_cast<unsigned>(CPU_COUNT(&cpuset));
+    if (allowed > 0 && (cpus == 0 || allowed < cpus)) {
+      cpus = allowed;
+    }
+  }
+
+  double quota = cgroup_cpu_quota();
+  if (quota > 0.0) {
+    unsigned quota_cpus = static_cast<unsigned>(std::ceil(quota));
+    if (quota_cpus > 0 && (cpus == 0 || quota_cpus < cpus)) {
+      cpus = quota_cpus;
+    }
+  }
+
+  return cpus > 0 ? cpus : 1;
+}
+
+int cpu_numa_node(int cpu) {
+  // the cpu directory links to its node as nodeN
+  std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/node";
+  for (int node = 0; node < 1024; node++) {
+    if (access((dir + std::to_string(node)).c_str(), F_OK) == 0) {
+      return node;
+    }
+  }
+  return -1;
+}
+
+unsigned numa_node_count() {
+  // "0-1,3": a list of ranges
+  std::ifstream online("/sys/devices/system/node/online");
+  std::string ranges;
+  if (!std::getline(online, ranges)) {
+    return 1;
+  }
+  unsigned count = 0;
+  size_t pos = 0;
+  while (pos < ranges.size()) {
+    size_t comma = ranges.find(',', pos);
+    std::string range = ranges.substr(pos, comma == std::string::npos ? std::string::npos : comma - pos);
+    size_t dash = range.find('-');
+    int first = std::atoi(range.c_str());
+    int last = dash == std::string::npos ? first : std::atoi(range.c_str() + dash + 1);
+    count += static_cast<unsigned>(last - first + 1);
+    pos = comma == std::string::npos ? ranges.size() : comma + 1;
+  }
+  return count > 0 ? count : 1;
+}
+
+WorkerPool::WorkerPool(unsigned num_workers) {
+  for (unsigned i = 1; i < num_workers; i++) {
+    _threads.push_back(std::thread(&WorkerPool::worker_loop, this, i));
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stop = true;
+  }
+  _start_cv.notify_all();
+  for (auto &thread : _threads) {
+    thread.join();
+  }
+}
+
+bool WorkerPool::pin_workers() {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    return false;
+  }
+  std::vector<int> cpus;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &allowed)) {
+      cpus.push_back(cpu);
+    }
+  }
+  if (cpus.empty()) {
+    return false;
+  }
+
+  // all or nothing: the masks the workers had, restored if any of them cannot be pinned
+  std::vector<pthread_t> threads(size());
+  std::vector<cpu_set_t> masks(size());
+  for (unsigned w = 0; w < size(); w++) {
+    threads[w] = w == 0 ? pthread_self() : _threads[w - 1].native_handle();
+    if (pthread_getaffinity_np(threads[w], sizeof(masks[w]), &masks[w]) != 0) {
+      return false;
+    }
+  }
+
+  std::vector<int> pinned(size());
+  for (unsigned w = 0; w < size(); w++) {
+    pinned[w] = cpus[w % cpus.size()];
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(pinned[w], &cpuset);
+    if (pthread_setaffinity_np(threads[w], sizeof(cpuset), &cpuset) != 0) {
+      for (unsigned done = 0; done < w; done++) {
+        pthread_setaffinity_np(threads[done], sizeof(masks[done]), &masks[done]);
+      }
+      return false;
+    }
+  }
+  _cpus = pinned;
+  return true;
+}
+
+void WorkerPool::worker_loop(unsigned index) {
+  unsigned long seen = 0;
+  for (;;) {
+    void (*call)(const void*, unsigned);
+    const void* job;
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _start_cv.wait(lock, [&] { return _stop || _generation != seen; });
+      if (_stop) {
+        return;
+      }
+      seen = _generation;
+      call = _call;
+      job = _job;
+    }
+
+    call(job, index);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (--_pending == 0) {
+      _done_cv.notify_one();
+    }
+  }
+}
+
+void WorkerPool::run(void (*call)(const void* job, unsigned index), const void* job) {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _call = call;
+    _job = job;
+    _pending = static_cast<unsigned>(_threads.size());
+    _generation++;
+  }
+  _start_cv.notify_all();
+
+  call(job, 0);
+
+  std::unique_lock<std::mutex> lock(_mutex);
+  _done_cv.wait(lock, [&] { return _pending == 0; });
+  _call = nullptr;
+  _job = nullptr;
+}
+
+}
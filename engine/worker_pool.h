@@ -0,0 +1,83 @@
+#ifndef MC_WORKER_POOL_H
+#define MC_WORKER_POOL_H
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mc {
+
+// CPU quota granted to this process by its cgroup, in CPUs, or 0 if unlimited/unknown.
+// Containers (Lambda in particular, which grants vCPUs in proportion to memory) enforce
+// it as a CFS quota, so hardware_concurrency() alone over-reports what we may use.
+double cgroup_cpu_quota();
+
+// Number of worker threads to price with: the smallest of hardware_concurrency, the
+// scheduler affinity mask and the cgroup quota. PRICING_THREADS overrides detection.
+unsigned detect_available_cpus();
+
+// NUMA node of a CPU as sysfs reports it, or -1 without NUMA support.
+int cpu_numa_node(int cpu);
+
+// Number of NUMA nodes with CPUs or memory online, 1 without NUMA support.
+unsigned numa_node_count();
+
+// Fixed set of threads created once and reused for every pricing run.
+// run() is a fork/join: the calling thread takes worker index 0, the pool threads the rest.
+class WorkerPool {
+  private:
+    std::vector<std::thread> _threads;
+    std::vector<int> _cpus;  // CPU of each worker once pinned
+    std::mutex _mutex;
+    std::condition_variable _start_cv;
+    std::condition_variable _done_cv;
+    void (*_call)(const void* job, unsigned index) = nullptr;
+    const void* _job = nullptr;
+    unsigned long _generation = 0;
+    unsigned _pending = 0;
+    bool _stop = false;
+
+    void worker_loop(unsigned index);
+
+    template <class Job>
+    static void invoke(const void* job, unsigned index) {
+      (*static_cast<Job const*>(job))(index);
+    }
+
+    void run(void (*call)(const void* job, unsigned index), const void* job);
+
+  public:
+    explicit WorkerPool(unsigned num_workers);
+    ~WorkerPool();
+
+    WorkerPool(WorkerPool const&) = delete;
+    WorkerPool& operator=(WorkerPool const&) = delete;
+
+    unsigned size() const {
+      return static_cast<unsigned>(_threads.size()) + 1;
+    }
+
+    // Pins worker w to the w-th CPU of the calling thread's affinity mask, round robin when
+    // there are more workers than CPUs, as sim's demo mode pins its threads. Worker 0 is
+    // the calling thread, which stays pinned. False, with every worker's affinity as it was,
+    // if a mask cannot be read or a thread cannot be pinned.
+    bool pin_workers();
+
+    // the CPU worker w is pinned to, -1 if it is not
+    int worker_cpu(unsigned w) const {
+      return w < _cpus.size() ? _cpus[w] : -1;
+    }
+
+    // Runs job(worker_index) once on every worker and returns when all have finished.
+    // The job is called in place through a function pointer, never copied into a
+    // std::function, so a run does not allocate.
+    template <class Job>
+    void run(Job const& job) {
+      run(&invoke<Job>, &job);
+    }
+};
+
+}
+
+#endif
@@ -1,197 +1,963 @@
 #include <algorithm>
-#include <cmath>
-#include <iostream>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdarg>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
 #include <thread>
 #include <vector>
-#include <random>
+#include <sstream>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
 #include <aws/core/Aws.h>
-#include <aws/core/utils/json/JsonSerializer.h>
 #include <aws/core/utils/logging/LogLevel.h>
-#include <aws/core/utils/logging/ConsoleLogSystem.h>
+#include <aws/core/utils/logging/FormattedLogSystem.h>
 #include <aws/core/utils/logging/LogMacros.h>
 #include <aws/core/platform/Environment.h>
 #include <aws/core/client/ClientConfiguration.h>
 #include <aws/core/auth/AWSCredentialsProvider.h>
+#include <aws/core/auth/AWSAuthSigner.h>
 #include <aws/s3/S3Client.h>
 #include <aws/s3/model/PutObjectRequest.h>
+#include <aws/s3/model/CreateMultipartUploadRequest.h>
+#include <aws/s3/model/UploadPartRequest.h>
+#include <aws/s3/model/CompleteMultipartUploadRequest.h>
+#include <aws/s3/model/AbortMultipartUploadRequest.h>
+#include <aws/s3/model/CompletedMultipartUpload.h>
+#include <aws/s3/model/CompletedPart.h>
 #include <aws/lambda-runtime/runtime.h>
 
+#include "engine/async_log.h"
+#include "engine/json_request.h"
+#include "engine/mc_engine.h"
+#include "engine/result_cache.h"
+#include "engine/result_format.h"
+
 using namespace aws::lambda_runtime;
+using namespace mc;
 
 char const TAG[] = "LAMBDA_ALLOC";
 
+// counters summed over all workers of a run; unavailable ones are left out
+static void log_perf_counters(PerfSample const& sample)
+{
+	LogField fields[LOG_MAX_FIELDS];
+	size_t count = 0;
+	for (int e = 0; e < PERF_EVENT_COUNT && count < LOG_MAX_FIELDS; e++) {
+		if (sample.valid[e]) {
+			fields[count++] = LogField(perf_event_name(e), static_cast<unsigned long long>(sample.values[e]));
+		}
+	}
+	if (sample.ipc() > 0.0 && count < LOG_MAX_FIELDS) {
+		fields[count++] = LogField("ipc", sample.ipc());
+	}
+	if (count == 0) {
+		log_event(LogLevel::Info, "perf_counters", {{"available", "false"}});
+		return;
+	}
+	AsyncLogger::instance().log(LogLevel::Info, "perf_counters", fields, count, nullptr, 0);
+}
+
 class MonteCarloSimThread {
     private:
-       int _num_sims;    	//no of simulated asset paths
-       double _S;        	//option price
-       double _K;      		//strike price
-       double _r;	        //risk-free rate
-       double _v;         	//volatility of the underlying (20%)
-       double _T;         	//one year until expiry
+       mc::Contract _contract;
+
+	public:
+        MonteCarloSimThread(const int& _num_sims, const double& _S, const double& _K, const double& _r, const double& _v, const double& _T)
+		: _contract{_num_sims, _S, _K, _r, _v, _T} {}
 
+	PricingResult run(EngineContext& engine, Precision precision) {
+		auto result = mc::price(engine, _contract, precision);
 
-        std::random_device rd;
-        std::mt19937 gen{rd()};
-        std::normal_distribution<double> distribution{0.0, 1.0};
+		log_event(LogLevel::Info, "priced", {
+			{"workers", engine.pool.size()}, {"paths", result.num_sims}, {"underlying", result.S}, {"strike", result.K},
+			{"rate", result.r}, {"volatility", result.v}, {"maturity", result.T}, {"call", result.call}, {"put", result.put},
+			{"precision", precision_name(precision)}});
 
-        double gaussian_rnd() {
-          return distribution(gen);
+		if (engine.perf_enabled) {
+			log_perf_counters(engine.perf_total());
+		}
+		return result;
         }
+};
 
-        double monte_carlo_call_price(const int& num_sims, const double& S, const double& K, const double& r, const double& v, const double& T) {
-                double S_adjust = S * exp(T*(r-0.5*v*v));
-                double S_cur = 0.0;
-                double payoff_sum = 0.0;
+// AWS_LOG_LEVEL: off, fatal, error, warn (default), info, debug or trace
+static Aws::Utils::Logging::LogLevel sdk_log_level_from_env()
+{
+	using Aws::Utils::Logging::LogLevel;
+	auto level = Aws::Environment::GetEnv("AWS_LOG_LEVEL");
+	std::transform(level.begin(), level.end(), level.begin(), ::tolower);
+	if (level == "off") return LogLevel::Off;
+	if (level == "fatal") return LogLevel::Fatal;
+	if (level == "error") return LogLevel::Error;
+	if (level == "info") return LogLevel::Info;
+	if (level == "debug") return LogLevel::Debug;
+	if (level == "trace") return LogLevel::Trace;
+	return LogLevel::Warn;
+}
 
-                for(int i=0; i < num_sims; i++) {
-                        double gauss_bm = gaussian_rnd();
-                        S_cur = S_adjust * exp(sqrt(v*v*T)*gauss_bm);
-                        payoff_sum += std::max(S_cur - K, 0.0);
-                        printThreadAllocation(i);
-                }
+// Routes AWS SDK log statements into the async logger. The SDK formats them on its own
+// threads; they are copied into the ring and written off-thread like everything else.
+// Each statement is logged at the level the SDK gave it, so LOG_LEVEL=warn still keeps
+// SDK warnings and errors such as failed uploads.
+class AsyncSdkLogSystem : public Aws::Utils::Logging::FormattedLogSystem {
+	private:
+		// level of the statement being formatted on this thread
+		static mc::LogLevel& statement_level() {
+			static thread_local mc::LogLevel level = mc::LogLevel::Info;
+			return level;
+		}
 
-                return (payoff_sum / static_cast<double>(num_sims)) * exp(-r*T);
-        }
+		static mc::LogLevel to_mc_level(Aws::Utils::Logging::LogLevel level) {
+			using Aws::Utils::Logging::LogLevel;
+			switch (level) {
+				case LogLevel::Fatal:
+				case LogLevel::Error: return mc::LogLevel::Error;
+				case LogLevel::Warn: return mc::LogLevel::Warn;
+				case LogLevel::Info: return mc::LogLevel::Info;
+				default: return mc::LogLevel::Debug;
+			}
+		}
 
+	public:
+		explicit AsyncSdkLogSystem(Aws::Utils::Logging::LogLevel level) : FormattedLogSystem(level) {}
+
+		// printf-style statements are formatted here and go through LogStream, so the base
+		// class adds its prefix whatever SDK version provides the variadic overload
+		void Log(Aws::Utils::Logging::LogLevel level, const char* tag, const char* format, ...) override {
+			char message[1024];
+			va_list args;
+			va_start(args, format);
+			vsnprintf(message, sizeof(message), format, args);
+			va_end(args);
+			Aws::OStringStream stream;
+			stream << message;
+			LogStream(level, tag, stream);
+		}
 
-        double monte_carlo_put_price(const int& num_sims, const double& S, const double& K, const double& r, const double& v, const double& T) {
-                double S_adjust = S * exp(T*(r-0.5*v*v));
-                double S_cur = 0.0;
-                double payoff_sum = 0.0;
+		void LogStream(Aws::Utils::Logging::LogLevel level, const char* tag, const Aws::OStringStream& stream) override {
+			statement_level() = to_mc_level(level);
+			FormattedLogSystem::LogStream(level, tag, stream);
+		}
 
-                for(int i=0; i < num_sims; i++) {
-                        double gauss_bm = gaussian_rnd();
-                        S_cur = S_adjust * exp(sqrt(v*v*T)*gauss_bm);
-                        payoff_sum += std::max(K - S_cur, 0.0);
-                        printThreadAllocation(i);
-                }
+		void Flush() override {
+			AsyncLogger::instance().flush();
+		}
 
-                return (payoff_sum / static_cast<double>(num_sims)) * exp(-r*T);
-        }
+	protected:
+		void ProcessFormattedStatement(Aws::String&& statement) override {
+			log_event(statement_level(), "aws_sdk", {}, statement);
+		}
+};
 
-        void printThreadAllocation(int i) {
-                if (i % 1000000 == 0) {
-			std::cerr << "Processed #" << i  << " paths\n";
-                }
-        }
+std::function<std::shared_ptr<Aws::Utils::Logging::LogSystemInterface>()> GetAsyncLoggerFactory(Aws::Utils::Logging::LogLevel level)
+{
+	return [level] {
+		return Aws::MakeShared<AsyncSdkLogSystem>("async_logger", level);
+	};
+}
+
+// The AWS SDK and the S3 client, initialised when first needed rather than in main.
+class S3Session {
+	private:
+		Aws::SDKOptions _options;
+		std::unique_ptr<Aws::S3::S3Client> _client;
 
 	public:
+		S3Session() {
+			using namespace Aws;
+			_options.loggingOptions.logLevel = sdk_log_level_from_env();
+			_options.loggingOptions.logger_create_fn = GetAsyncLoggerFactory(_options.loggingOptions.logLevel);
+			InitAPI(_options);
+
+			Client::ClientConfiguration config;
+			config.region = Aws::Environment::GetEnv("AWS_REGION");
+			config.caFile = "/etc/pki/tls/certs/ca-bundle.crt";
+
+			// S3_ENDPOINT points the client at an S3-compatible stand-in, e.g. http://localhost:9000;
+			// those generally only support path-style addressing
+			auto endpoint = Aws::Environment::GetEnv("S3_ENDPOINT");
+			bool virtualAddressing = endpoint.empty();
+			if (!endpoint.empty()) {
+				config.scheme = endpoint.compare(0, 7, "http://") == 0 ? Http::Scheme::HTTP : Http::Scheme::HTTPS;
+				auto scheme_end = endpoint.find("://");
+				config.endpointOverride = scheme_end == Aws::String::npos ? endpoint : endpoint.substr(scheme_end + 3);
+			}
+
+			auto credentialsProvider = Aws::MakeShared<Aws::Auth::EnvironmentAWSCredentialsProvider>(TAG);
+			_client.reset(new S3::S3Client(credentialsProvider, config, Client::AWSAuthV4Signer::PayloadSigningPolicy::Never, virtualAddressing));
+		}
 
+		~S3Session() {
+			_client.reset();
+			Aws::ShutdownAPI(_options);
+		}
 
-        MonteCarloSimThread(const int& _num_sims, const double& _S, const double& _K, const double& _r, const double& _v, const double& _T) 
-	{
-		this -> _num_sims = _num_sims;
-                this -> _S = _S;
-                this -> _K = _K;
-                this -> _r = _r;
-                this -> _v = _v;
-                this -> _T = _T;
-	}
+		S3Session(S3Session const&) = delete;
+		S3Session& operator=(S3Session const&) = delete;
 
-	void run(Aws::S3::S3Client const& s3client, std::string const& reqId) {
-                double call = monte_carlo_call_price(_num_sims, _S, _K, _r, _v, _T);
-                double put = monte_carlo_put_price(_num_sims, _S, _K, _r, _v, _T);
+		Aws::S3::S3Client const& client() const {
+			return *_client;
+		}
+};
 
-		Aws::StringStream ss;
+// Publishes result objects to RESULT_BUCKET/RESULT_PREFIX from one background thread, so
+// S3 round trips overlap pricing instead of following it. A result is sent as a single
+// PutObject unless it grows past UPLOAD_PART_SIZE bytes; from then on it becomes a
+// multipart upload and every full part goes out while the next contracts are priced.
+class ResultUploader {
+	private:
+		std::unique_ptr<S3Session> _session;
+		std::atomic<double> _sdk_init_ms{0.0};
+		Aws::String _bucket;
+		Aws::String _prefix;
+		size_t _part_size;
+
+		std::mutex _mutex;
+		std::condition_variable _cv;
+		std::deque<std::function<void()>> _tasks;
+		bool _stop = false;
+		bool _started = false;  // handler thread only
+		std::thread _thread;
+
+		void worker_loop() {
+			for (;;) {
+				std::function<void()> task;
+				{
+					std::unique_lock<std::mutex> lock(_mutex);
+					_cv.wait(lock, [&] { return _stop || !_tasks.empty(); });
+					if (_tasks.empty()) {
+						return;
+					}
+					task = std::move(_tasks.front());
+					_tasks.pop_front();
+				}
+				if (!_session) {
+					auto start = std::chrono::steady_clock::now();
+					_session.reset(new S3Session());
+					_sdk_init_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+				}
+				ScopedTimer timer(PHASE_UPLOAD);
+				task();
+			}
+		}
 
-		ss << "No of paths, Underlying, Strike, RiskFree Rate, Volatility, Maturity, Call Price, Put Price\n";
-		ss << _num_sims << "," << _S << "," << _K << "," << _r << "," << _v << "," << _T << "," << call << "," << put << "\n";
+		void submit(std::function<void()> task) {
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_tasks.push_back(std::move(task));
+			}
+			_cv.notify_one();
+		}
 
-		std::cerr << "No of paths           " << _num_sims << "\n";
-		std::cerr << "Underlying:           " << _S << "\n";
-		std::cerr << "Strike:               " << _K << "\n";
-		std::cerr << "Risk-Free rate:       " << _r << "\n";
-		std::cerr << "Volatility:           " << _v << "\n";
-		std::cerr << "Maturity:             " << _T << "\n";
-		std::cerr << "CALL Price:           " << call << "\n";
-		std::cerr << "PUT  Price:           " << put << "\n";
+		static std::shared_ptr<Aws::IOStream> make_body(Aws::String const& data) {
+			return Aws::MakeShared<Aws::StringStream>(TAG, data);
+		}
 
-		write_result_to_s3(ss.str().c_str(), s3client, reqId); 
-        }
+	public:
+		// Multipart state is only read and written by tasks on the uploader thread,
+		// which run in submission order.
+		struct MultipartState {
+			Aws::String upload_id;
+			Aws::Vector<Aws::S3::Model::CompletedPart> parts;
+			bool failed = false;
+		};
+
+		// One result object. append() and finish() are called from the handler thread.
+		class Upload {
+			private:
+				ResultUploader& _uploader;
+				Aws::String _key;
+				Aws::String _content_type;
+				Aws::String _buffer;
+				int _parts_sent = 0;
+				std::shared_ptr<MultipartState> _state;
+
+				void send_part() {
+					ResultUploader* uploader = &_uploader;
+					auto state = _state;
+					auto key = _key;
+
+					if (_parts_sent == 0) {
+						auto content_type = _content_type;
+						uploader->submit([uploader, state, key, content_type] {
+							Aws::S3::Model::CreateMultipartUploadRequest request;
+							request.SetBucket(uploader->_bucket);
+							request.SetKey(key);
+							request.SetContentType(content_type);
+							auto outcome = uploader->_session->client().CreateMultipartUpload(request);
+							if (!outcome.IsSuccess()) {
+								log_event(LogLevel::Error, "create_multipart_upload_failed", {}, outcome.GetError().GetMessage());
+								state->failed = true;
+								return;
+							}
+							state->upload_id = outcome.GetResult().GetUploadId();
+						});
+					}
+
+					int part_number = ++_parts_sent;
+					auto body = std::make_shared<Aws::String>();
+					body->swap(_buffer);
+					uploader->submit([uploader, state, key, part_number, body] {
+						if (state->failed) {
+							return;
+						}
+						Aws::S3::Model::UploadPartRequest request;
+						request.SetBucket(uploader->_bucket);
+						request.SetKey(key);
+						request.SetUploadId(state->upload_id);
+						request.SetPartNumber(part_number);
+						request.SetBody(make_body(*body));
+						request.SetContentLength(static_cast<long long>(body->size()));
+						metrics_add(PHASE_UPLOAD, 0, body->size());
+						auto outcome = uploader->_session->client().UploadPart(request);
+						if (!outcome.IsSuccess()) {
+							log_event(LogLevel::Error, "upload_part_failed", {{"part", part_number}}, outcome.GetError().GetMessage());
+							state->failed = true;
+							return;
+						}
+						state->parts.push_back(Aws::S3::Model::CompletedPart().WithETag(outcome.GetResult().GetETag()).WithPartNumber(part_number));
+					});
+				}
+
+			public:
+				Upload(ResultUploader& uploader, Aws::String key, Aws::String content_type)
+					: _uploader(uploader), _key(std::move(key)), _content_type(std::move(content_type)),
+					  _state(std::make_shared<MultipartState>()) {}
+
+				Aws::String const& key() const {
+					return _key;
+				}
+
+				void append(Aws::String const& data) {
+					_buffer += data;
+					if (_buffer.size() >= _uploader._part_size) {
+						send_part();
+					}
+				}
+
+				// Sends whatever is buffered, waits for every outstanding request of this
+				// object and returns whether the object was stored.
+				bool finish() {
+					ResultUploader* uploader = &_uploader;
+					auto state = _state;
+					auto key = _key;
+					auto done = std::make_shared<std::promise<bool>>();
+					auto stored = done->get_future();
+
+					if (_parts_sent == 0) {
+						auto body = std::make_shared<Aws::String>();
+						body->swap(_buffer);
+						auto content_type = _content_type;
+						uploader->submit([uploader, key, content_type, body, done] {
+							Aws::S3::Model::PutObjectRequest request;
+							request.SetBucket(uploader->_bucket);
+							request.SetKey(key);
+							request.SetBody(make_body(*body));
+							request.SetContentLength(static_cast<long long>(body->size()));
+							request.SetContentType(content_type);
+							metrics_add(PHASE_UPLOAD, 0, body->size());
+							auto outcome = uploader->_session->client().PutObject(request);
+							if (!outcome.IsSuccess()) {
+								log_event(LogLevel::Error, "put_object_failed", {}, outcome.GetError().GetMessage());
+							}
+							done->set_value(outcome.IsSuccess());
+						});
+					} else {
+						if (!_buffer.empty()) {
+							send_part();
+						}
+						uploader->submit([uploader, state, key, done] {
+							if (state->failed) {
+								if (!state->upload_id.empty()) {
+									Aws::S3::Model::AbortMultipartUploadRequest request;
+									request.SetBucket(uploader->_bucket);
+									request.SetKey(key);
+									request.SetUploadId(state->upload_id);
+									uploader->_session->client().AbortMultipartUpload(request);
+								}
+								done->set_value(false);
+								return;
+							}
+							Aws::S3::Model::CompletedMultipartUpload completed;
+							completed.SetParts(state->parts);
+							Aws::S3::Model::CompleteMultipartUploadRequest request;
+							request.SetBucket(uploader->_bucket);
+							request.SetKey(key);
+							request.SetUploadId(state->upload_id);
+							request.SetMultipartUpload(completed);
+							auto outcome = uploader->_session->client().CompleteMultipartUpload(request);
+							if (!outcome.IsSuccess()) {
+								log_event(LogLevel::Error, "complete_multipart_upload_failed", {}, outcome.GetError().GetMessage());
+							}
+							done->set_value(outcome.IsSuccess());
+						});
+					}
+
+					bool ok = stored.get();
+					if (ok) {
+						log_event(LogLevel::Info, "uploaded", {{"parts", _parts_sent}}, _uploader._bucket + "/" + _key);
+					}
+					return ok;
+				}
+		};
+
+		ResultUploader()
+			: _bucket(Aws::Environment::GetEnv("RESULT_BUCKET")),
+			  _prefix(Aws::Environment::GetEnv("RESULT_PREFIX")),
+			  _part_size(8 * 1024 * 1024) {
+			// S3 rejects multipart parts under 5MiB, except the last one
+			auto part_size = Aws::Environment::GetEnv("UPLOAD_PART_SIZE");
+			if (!part_size.empty()) {
+				_part_size = std::max<size_t>(std::strtoull(part_size.c_str(), nullptr, 10), 5 * 1024 * 1024);
+			}
+			_thread = std::thread(&ResultUploader::worker_loop, this);
+		}
 
-	bool write_result_to_s3(std::string const& message, Aws::S3::S3Client const s3client, std::string const& reqId) {
-		Aws::S3::Model::PutObjectRequest request;                               
-		auto bucketName = Aws::Environment::GetEnv("RESULT_BUCKET");
-		auto objectPrefix = Aws::Environment::GetEnv("RESULT_PREFIX");
-		request.SetBucket(bucketName);
-		request.SetKey(objectPrefix + reqId + ".csv");
-	
-		std::shared_ptr<Aws::IOStream> data = Aws::MakeShared<Aws::StringStream>("");
-		*data << message.c_str();
-		data->flush();
-
-		request.SetBody(data);
-		request.SetContentLength(static_cast<long>(request.GetBody()->tellp()));
-		request.SetContentType("text/plain");
-
-		Aws::S3::Model::PutObjectOutcome outcome = s3client.PutObject(request);
-	
-		if (!outcome.IsSuccess()) {                                     
-			std::cerr << "Error: PutObjectBuffer: " << outcome.GetError().GetMessage() << "\n";
-			return false; 
-		} else {
-			std::cerr << "Success: Object '" << reqId << "' uploaded to bucket " << bucketName << "\n";
-			return true;
+		~ResultUploader() {
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_stop = true;
+			}
+			_cv.notify_one();
+			_thread.join();
+		}
+
+		// time the lazy SDK and S3 client initialisation took, 0 until it has finished
+		double sdk_init_ms() const {
+			return _sdk_init_ms;
 		}
+
+		ResultUploader(ResultUploader const&) = delete;
+		ResultUploader& operator=(ResultUploader const&) = delete;
+
+		// The first upload queues an empty task, so the uploader thread builds the session
+		// while the contracts are priced; a small result is otherwise only queued once it
+		// is complete.
+		Upload begin(Aws::String const& name, Aws::String const& content_type) {
+			if (!_started) {
+				_started = true;
+				submit([] {});
+			}
+			return Upload(*this, _prefix + name, content_type);
+		}
+
+		// s3://bucket/key of an upload
+		Aws::String location(Upload const& upload) const {
+			return "s3://" + _bucket + "/" + upload.key();
+		}
+};
+
+// rows per binary row group, ~4MB of columns
+static const size_t BINARY_ROW_GROUP_ROWS = 65536;
+
+static void append_csv_row(Aws::StringStream& ss, PricingResult const& result)
+{
+	ss << result.num_sims << "," << result.S << "," << result.K << "," << result.r << "," << result.v << "," << result.T << "," << result.call << "," << result.put << "\n";
+}
+
+// prices round-trip with 17 significant digits
+static std::string json_number(double value)
+{
+	char text[32];
+	snprintf(text, sizeof(text), "%.17g", value);
+	return text;
+}
+
+static std::string base64(std::string const& data)
+{
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	std::string out;
+	for (size_t i = 0; i < data.size(); i += 3) {
+		unsigned int bits = static_cast<unsigned char>(data[i]) << 16;
+		if (i + 1 < data.size()) bits |= static_cast<unsigned char>(data[i + 1]) << 8;
+		if (i + 2 < data.size()) bits |= static_cast<unsigned char>(data[i + 2]);
+		out.push_back(alphabet[(bits >> 18) & 63]);
+		out.push_back(alphabet[(bits >> 12) & 63]);
+		out.push_back(i + 1 < data.size() ? alphabet[(bits >> 6) & 63] : '=');
+		out.push_back(i + 2 < data.size() ? alphabet[bits & 63] : '=');
 	}
+	return out;
+}
+
+// The response body of one invocation, sent to the Runtime API in chunks while it is being
+// produced. Used with RESPONSE_STREAMING=1, for functions whose invoke mode is
+// RESPONSE_STREAM; the runtime client library only posts complete responses, so this speaks
+// HTTP/1.1 chunked encoding to AWS_LAMBDA_RUNTIME_API itself. The connection is opened with
+// the first chunk: a handler that fails before writing anything still reports its error
+// through the runtime client as usual.
+class ResponseStream {
+	private:
+		std::string _host;
+		std::string _request_id;
+		std::string _buffer;
+		std::chrono::steady_clock::time_point _last_flush;
+		int _fd = -1;
+		bool _started = false;
+
+		// chunks are sent once this much is buffered or this long after the previous one
+		static const size_t FLUSH_BYTES = 16 * 1024;
+		static constexpr double FLUSH_MS = 50.0;
+
+		bool send_all(std::string const& data) {
+			size_t sent = 0;
+			while (_fd >= 0 && sent < data.size()) {
+				ssize_t n = ::send(_fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+				if (n < 0 && errno == EINTR) {
+					continue;
+				}
+				if (n <= 0) {
+					log_event(LogLevel::Error, "response_stream_failed", {}, std::strerror(errno));
+					::close(_fd);
+					_fd = -1;
+					return false;
+				}
+				sent += static_cast<size_t>(n);
+			}
+			return _fd >= 0;
+		}
+
+		bool open() {
+			_started = true;
+			auto colon = _host.rfind(':');
+			struct addrinfo hints = {};
+			hints.ai_family = AF_UNSPEC;
+			hints.ai_socktype = SOCK_STREAM;
+			struct addrinfo* addresses = nullptr;
+			if (colon == std::string::npos || getaddrinfo(_host.substr(0, colon).c_str(), _host.substr(colon + 1).c_str(), &hints, &addresses) != 0) {
+				log_event(LogLevel::Error, "response_stream_failed", {}, "cannot resolve " + _host);
+				return false;
+			}
+			for (auto* a = addresses; a && _fd < 0; a = a->ai_next) {
+				_fd = ::socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+				if (_fd >= 0 && ::connect(_fd, a->ai_addr, a->ai_addrlen) != 0) {
+					::close(_fd);
+					_fd = -1;
+				}
+			}
+			freeaddrinfo(addresses);
+			if (_fd < 0) {
+				log_event(LogLevel::Error, "response_stream_failed", {}, "cannot connect to " + _host);
+				return false;
+			}
+			return send_all("POST /2018-06-01/runtime/invocation/" + _request_id + "/response HTTP/1.1\r\n"
+					"Host: " + _host + "\r\n"
+					"Lambda-Runtime-Function-Response-Mode: streaming\r\n"
+					"Transfer-Encoding: chunked\r\n"
+					"Content-Type: application/x-ndjson\r\n"
+					"Trailer: Lambda-Runtime-Function-Error-Type, Lambda-Runtime-Function-Error-Body\r\n"
+					"\r\n");
+		}
+
+		void flush() {
+			if (!_started && !open()) {
+				_buffer.clear();
+				return;
+			}
+			if (!_buffer.empty()) {
+				char size[24];
+				snprintf(size, sizeof(size), "%zx\r\n", _buffer.size());
+				send_all(size + _buffer + "\r\n");
+				_buffer.clear();
+			}
+			_last_flush = std::chrono::steady_clock::now();
+		}
+
+		// Ends the body, with trailers if any, and waits for the Runtime API to accept it.
+		bool close(std::string const& trailers) {
+			flush();
+			if (!send_all("0\r\n" + trailers + "\r\n")) {
+				return false;
+			}
+			char status[64];
+			ssize_t n;
+			do {
+				n = ::recv(_fd, status, sizeof(status) - 1, 0);
+			} while (n < 0 && errno == EINTR);
+			::close(_fd);
+			_fd = -1;
+			status[n > 0 ? n : 0] = '\0';
+			// "HTTP/1.1 202 Accepted"
+			bool accepted = std::strncmp(status, "HTTP/1.1 202", 12) == 0;
+			if (!accepted) {
+				log_event(LogLevel::Error, "response_stream_rejected", {}, std::string(status, std::strcspn(status, "\r\n")));
+			}
+			return accepted;
+		}
+
+	public:
+		ResponseStream(std::string host, std::string request_id)
+			: _host(std::move(host)), _request_id(std::move(request_id)), _last_flush(std::chrono::steady_clock::now()) {}
+
+		~ResponseStream() {
+			if (_fd >= 0) {
+				::close(_fd);
+			}
+		}
+
+		ResponseStream(ResponseStream const&) = delete;
+		ResponseStream& operator=(ResponseStream const&) = delete;
+
+		// whether any of the response has been sent; it is then completed with finish() or fail()
+		bool started() const {
+			return _started;
+		}
+
+		void write(std::string const& data) {
+			_buffer += data;
+			if (_buffer.size() >= FLUSH_BYTES || std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - _last_flush).count() >= FLUSH_MS) {
+				flush();
+			}
+		}
+
+		bool finish() {
+			return close("");
+		}
+
+		// Ends a response that has already been partly sent with an error, which the
+		// caller sees in place of the rest of the body.
+		bool fail(std::string const& error_type, std::string const& message) {
+			std::string body = "{\"errorMessage\":\"" + message + "\",\"errorType\":\"" + error_type + "\",\"stackTrace\":[]}";
+			return close("Lambda-Runtime-Function-Error-Type: " + error_type + "\r\n"
+					"Lambda-Runtime-Function-Error-Body: " + base64(body) + "\r\n");
+		}
+};
+
+// Prices and standard errors of an invocation's contracts, in request order. Without a
+// stream they are collected into one JSON response,
+//   {"results":[{"call":c,"put":p,"callStdErr":e,"putStdErr":e},...],"resultObject":"s3://..."}
+// cut short with "truncated":true where a synchronous response would outgrow Lambda's 6MB
+// limit (the result object always has them all). With a stream each result goes out as an
+// NDJSON line as soon as its contract is priced,
+//   {"index":i,"call":c,"put":p,"callStdErr":e,"putStdErr":e}
+// followed by {"done":true,"contracts":n,"resultObject":"s3://..."} once the upload is stored.
+class ResultResponse {
+	private:
+		ResponseStream* _stream;
+		std::string _body;
+		size_t _count = 0;
+		bool _truncated = false;
+
+		// leaves room for the closing fields under the 6MB synchronous response limit
+		static const size_t MAX_BODY_BYTES = 6 * 1000 * 1000 - 4096;
+
+		static std::string fields(PricingResult const& result) {
+			return "\"call\":" + json_number(result.call) + ",\"put\":" + json_number(result.put) +
+				",\"callStdErr\":" + json_number(result.call_stderr) + ",\"putStdErr\":" + json_number(result.put_stderr);
+		}
+
+	public:
+		explicit ResultResponse(ResponseStream* stream) : _stream(stream), _body("{\"results\":[") {}
+
+		void add(PricingResult const& result) {
+			if (_stream) {
+				_stream->write("{\"index\":" + std::to_string(_count) + "," + fields(result) + "}\n");
+			} else if (!_truncated) {
+				std::string item = (_count ? ",{" : "{") + fields(result) + "}";
+				if (_body.size() + item.size() > MAX_BODY_BYTES) {
+					_truncated = true;
+				} else {
+					_body += item;
+				}
+			}
+			_count++;
+		}
+
+		invocation_response success(std::string const& result_object) {
+			if (_stream) {
+				_stream->write("{\"done\":true,\"contracts\":" + std::to_string(_count) + ",\"resultObject\":\"" + result_object + "\"}\n");
+				_stream->finish();
+				return invocation_response::success("", "application/x-ndjson");
+			}
+			return invocation_response::success(_body + "],\"resultObject\":\"" + result_object + "\"" +
+					(_truncated ? ",\"truncated\":true}" : "}"), "application/json");
+		}
+
+		invocation_response failure(std::string const& message, std::string const& error_type) {
+			if (_stream && _stream->started()) {
+				_stream->fail(error_type, message);
+			}
+			return invocation_response::failure(message, error_type);
+		}
 };
 
-static invocation_response my_handler(invocation_request const& req, Aws::S3::S3Client const s3client)
+// Contracts are decoded from the payload straight into batch, which keeps its capacity
+// across warm invocations; stream is null unless the function streams its response.
+static invocation_response my_handler(invocation_request const& req, EngineContext& engine, ResultCache& cache, ResultUploader& uploader,
+		ContractBatch& batch, ResponseStream* stream)
 {
-	using namespace Aws::Utils::Json;
+	// a single contract, or a "contracts" array of them; "precision" is "double" (default),
+	// "float" or "float-kahan" and "seed" makes a contract deterministic and cacheable, both
+	// per contract or for the whole request
+	batch.clear();
+	JsonRequest request;
+	if (!parse_json_request(req.payload.data(), req.payload.data() + req.payload.size(), batch, request)) {
+		if (request.error == JsonError::Precision) {
+			return invocation_response::failure(request.message, "InvalidPrecision");
+		}
+		return invocation_response::failure("Failed to parse input JSON: " + request.message, "InvalidJSON");
+	}
+
+	// "logLevel" changes the log level of this container from now on
+	if (!request.log_level.empty()) {
+		auto& logger = AsyncLogger::instance();
+		logger.set_level(log_level_from_string(request.log_level.str(), logger.level()));
+	}
+
+	// "outputFormat": "binary" writes the columnar .mcr format from result_format.h instead of CSV
+	bool binary = request.output_format == "binary";
+
+	auto upload = binary
+		? uploader.begin(req.request_id + ".mcr", "application/octet-stream")
+		: uploader.begin(req.request_id + ".csv", "text/plain");
 
-//	JsonValue json(Aws::String(req.payload.c_str()));
-	JsonValue json(req.payload);
-	if (!json.WasParseSuccessful()) {
-		return invocation_response::failure("Failed to parse input JSON", "InvalidJSON");
+	ResultResponse response(stream);
+	BinaryResultWriter writer({ {"request_id", req.request_id}, {"worker_threads", std::to_string(engine.pool.size())} });
+	if (binary) {
+		upload.append(writer.header());
+	} else {
+		upload.append("No of paths, Underlying, Strike, RiskFree Rate, Volatility, Maturity, Call Price, Put Price\n");
 	}
-	auto v = json.View();
 
-	auto _num_sims = v.GetInteger("numberOfPaths");
-        auto _S = v.GetDouble("underlyingPrice"); 
-	auto _K = v.GetDouble("strikePrice");
-	auto _v = v.GetDouble("volatility");
-	constexpr double _r = 0.5;
-	constexpr double _T = 1.0;
+	for (size_t i = 0; i < batch.size(); i++) {
+		Contract const& contract = batch.contracts[i];
+		bool seeded = batch.seeded[i] != 0;
+		auto seed = batch.seeds[i];
+		Precision precision = batch.precisions[i];
+
+		CacheKey key;
+		bool cacheable = seeded && cache.enabled() && pricing_cache_key(contract.num_sims, contract.S, contract.K, contract.r, contract.v, contract.T,
+				seed, precision, key);
+
+		PricingResult result;
+		if (cacheable && cache.get(key, result)) {
+			log_event(LogLevel::Info, "cache_hit", {}, key.hex());
+		} else {
+			if (seeded) {
+				engine.seed(seed);
+			} else {
+				engine.unseed();
+			}
+			result = MonteCarloSimThread(contract.num_sims, contract.S, contract.K, contract.r, contract.v, contract.T).run(engine, precision);
+			if (cacheable) {
+				cache.put(key, result);
+			}
+		}
+
+		response.add(result);
+		if (binary) {
+			std::string row_group;
+			{
+				ScopedTimer timer(PHASE_SERIALISE, 1);
+				writer.add(result);
+				if (writer.rows() == BINARY_ROW_GROUP_ROWS) {
+					row_group = writer.flush_row_group();
+				}
+			}
+			if (!row_group.empty()) {
+				upload.append(row_group);
+			}
+		} else {
+			Aws::StringStream ss;
+			{
+				ScopedTimer timer(PHASE_SERIALISE, 1);
+				append_csv_row(ss, result);
+			}
+			upload.append(ss.str());
+		}
+	}
+	if (binary && writer.rows() > 0) {
+		std::string row_group;
+		{
+			ScopedTimer timer(PHASE_SERIALISE);
+			row_group = writer.flush_row_group();
+		}
+		upload.append(row_group);
+	}
 
-	MonteCarloSimThread(_num_sims, _S, _K, _r, _v, _T).run(s3client, req.request_id);
-	return invocation_response::success("Simulation Finished!", "application/json");
+	if (!upload.finish()) {
+		return response.failure("Failed to upload results to S3", "S3UploadFailed");
+	}
+	return response.success(uploader.location(upload));
 }
 
 
 
-std::function<std::shared_ptr<Aws::Utils::Logging::LogSystemInterface>()> GetConsoleLoggerFactory()
+// Phase durations from process exec to the end of the first invocation, logged once as a
+// single structured record so cold-start latency can be tracked per release.
+class StartupTimer {
+	private:
+		std::chrono::steady_clock::time_point _last;
+		LogField _phases[LOG_MAX_FIELDS];
+		size_t _count = 0;
+
+	public:
+		StartupTimer() : _last(std::chrono::steady_clock::now()) {
+			add("exec_to_main_ms", exec_to_main_ms());
+		}
+
+		// time from the previous mark; phase must be a string literal
+		void mark(const char* phase) {
+			auto now = std::chrono::steady_clock::now();
+			add(phase, std::chrono::duration<double, std::milli>(now - _last).count());
+			_last = now;
+		}
+
+		void add(const char* phase, double ms) {
+			if (_count < LOG_MAX_FIELDS) {
+				_phases[_count++] = LogField(phase, ms);
+			}
+		}
+
+		void report() {
+			auto version = Aws::Environment::GetEnv("AWS_LAMBDA_FUNCTION_VERSION");
+			AsyncLogger::instance().log(LogLevel::Info, "startup", _phases, _count, version.data(), version.size());
+		}
+
+		// process start time from /proc/self/stat, in clock ticks since boot
+		static double exec_to_main_ms() {
+			std::ifstream stat("/proc/self/stat");
+			std::string line;
+			if (!std::getline(stat, line)) {
+				return 0.0;
+			}
+			// fields after the ")" closing the command name; starttime is field 22
+			std::istringstream fields(line.substr(line.rfind(')') + 2));
+			std::string field;
+			for (int i = 3; i <= 22; i++) {
+				if (!(fields >> field)) {
+					return 0.0;
+				}
+			}
+			struct timespec boot;
+			if (clock_gettime(CLOCK_BOOTTIME, &boot) != 0) {
+				return 0.0;
+			}
+			double started = std::atof(field.c_str()) / static_cast<double>(sysconf(_SC_CLK_TCK));
+			double now = static_cast<double>(boot.tv_sec) + static_cast<double>(boot.tv_nsec) * 1e-9;
+			return (now - started) * 1000.0;
+		}
+};
+
+// Where this invocation's time went, as one "metrics" record, plus the METRICS_JSON and
+// METRICS_PROM files when configured. Uploads have finished by the time the handler returns.
+static void report_invocation_metrics(MetricsSnapshot const& total, MetricsSnapshot const& before, double wall_seconds)
 {
-	return [] {
-		return Aws::MakeShared<Aws::Utils::Logging::ConsoleLogSystem>(
-			"console_logger", Aws::Utils::Logging::LogLevel::Trace);
-	};
+	MetricsSnapshot run = total - before;
+	auto ms = [&](Phase phase) { return static_cast<double>(run.ns[phase]) * 1e-6; };
+	log_event(LogLevel::Info, "metrics", {
+		{"wall_ms", wall_seconds * 1e3}, {"rng_ms", ms(PHASE_RNG)}, {"path_ms", ms(PHASE_PATH)}, {"payoff_ms", ms(PHASE_PAYOFF)},
+		{"reduction_ms", ms(PHASE_REDUCTION)}, {"serialise_ms", ms(PHASE_SERIALISE)}, {"upload_ms", ms(PHASE_UPLOAD)},
+		{"paths", static_cast<unsigned long long>(run.items[PHASE_PATH])}, {"rows", static_cast<unsigned long long>(run.items[PHASE_SERIALISE])},
+		{"upload_bytes", static_cast<unsigned long long>(run.items[PHASE_UPLOAD])}});
+	if (!export_metrics_files(run, total, wall_seconds)) {
+		log_event(LogLevel::Warn, "metrics_export_failed");
+	}
 }
 
-int main() 
+// The runtime loop of run_handler for a streaming function: the handler gets a stream for
+// each invocation, and only a response it has not streamed is posted the usual way.
+static void run_streaming_handler(std::function<invocation_response(invocation_request const&, ResponseStream*)> const& handler)
 {
-	using namespace Aws;
-	SDKOptions options;
-	options.loggingOptions.logLevel = Aws::Utils::Logging::LogLevel::Trace;
-	options.loggingOptions.logger_create_fn = GetConsoleLoggerFactory();
-	InitAPI(options);
-	{
-
-		Client::ClientConfiguration config;
-		config.region = Aws::Environment::GetEnv("AWS_REGION");
-		config.caFile = "/etc/pki/tls/certs/ca-bundle.crt";
-
-		auto credentialsProvider = Aws::MakeShared<Aws::Auth::EnvironmentAWSCredentialsProvider>(TAG);
-		S3::S3Client s3client(credentialsProvider, config);
-		auto handler_fn = [&s3client](aws::lambda_runtime::invocation_request const& req) {
-			return my_handler(req, s3client);
-		};	
-
-		aws::lambda_runtime::run_handler(handler_fn);
+	std::string host = Aws::Environment::GetEnv("AWS_LAMBDA_RUNTIME_API");
+	runtime rt("http://" + host);
+	for (int failures = 0; failures < 3;) {
+		auto next = rt.get_next();
+		if (!next.is_success()) {
+			log_event(LogLevel::Error, "get_next_failed", {{"status", static_cast<int>(next.get_failure())}});
+			failures++;
+			continue;
+		}
+		failures = 0;
+		auto const& req = next.get_result();
+		ResponseStream stream(host, req.request_id);
+		auto response = handler(req, &stream);
+		if (stream.started()) {
+			continue;
+		}
+		auto posted = response.is_success() ? rt.post_success(req.request_id, response) : rt.post_failure(req.request_id, response);
+		if (!posted.is_success()) {
+			log_event(LogLevel::Error, "post_response_failed", {}, req.request_id);
+		}
 	}
-	ShutdownAPI(options);
-	return 0;
 }
 
+int main() 
+{
+	StartupTimer startup;
+
+	// created before the first invocation so warm invocations reuse threads, RNG state
+	// and buffers; PROGRESS_INTERVAL paths between progress lines, 0 to disable
+	auto interval = Aws::Environment::GetEnv("PROGRESS_INTERVAL");
+	EngineContext engine(detect_available_cpus(), interval.empty() ? 1000000 : std::atol(interval.c_str()), [](long done, long total) {
+		log_event(LogLevel::Debug, "progress", {{"done", done}, {"total", total}});
+	});
+	// METRICS=1 times every pricing and upload phase per invocation
+	set_metrics_enabled(metrics_from_env());
+
+	// PERF_COUNTERS=1 logs hardware counters for every pricing run
+	if (perf_counters_from_env()) {
+		engine.enable_perf_counters();
+	}
+	// kernel level picked from CPUID, or forced with MC_ISA
+	log_event(LogLevel::Info, "kernels", {{"isa", isa_name(active_isa())}, {"detected", isa_name(detect_isa())}});
+	startup.mark("engine_init_ms");
+
+	// RESULT_CACHE_ENTRIES results kept in memory across warm invocations (default 4096),
+	// RESULT_CACHE_DIR optionally persists them, e.g. on an EFS mount or /tmp
+	auto cache_entries = Aws::Environment::GetEnv("RESULT_CACHE_ENTRIES");
+	ResultCache cache(cache_entries.empty() ? 4096 : std::strtoul(cache_entries.c_str(), nullptr, 10),
+			Aws::Environment::GetEnv("RESULT_CACHE_DIR"));
+
+	// the SDK and S3 client come up on the uploader thread when the first upload begins,
+	// overlapping the first pricing run instead of delaying the first invocation
+	ResultUploader uploader;
+	ContractBatch batch;
+	startup.mark("main_init_ms");
+
+	bool first_invocation = true;
+	auto handler_fn = [&](aws::lambda_runtime::invocation_request const& req, ResponseStream* stream) {
+		if (first_invocation) {
+			startup.mark("runtime_to_first_invocation_ms");
+		}
+		auto metrics_before = metrics_snapshot();
+		auto invocation_start = std::chrono::steady_clock::now();
+
+		auto response = my_handler(req, engine, cache, uploader, batch, stream);
 
+		if (metrics_enabled()) {
+			double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - invocation_start).count();
+			report_invocation_metrics(metrics_snapshot(), metrics_before, wall);
+		}
+		if (first_invocation) {
+			startup.mark("first_invocation_ms");
+			startup.add("sdk_init_ms", uploader.sdk_init_ms());
+			startup.report();
+			first_invocation = false;
+		}
+		// the container may be frozen as soon as we return
+		AsyncLogger::instance().flush();
+		return response;
+	};
 
+	// RESPONSE_STREAMING=1 for functions with the RESPONSE_STREAM invoke mode: results are
+	// sent as each contract is priced instead of in one response at the end
+	if (Aws::Environment::GetEnv("RESPONSE_STREAMING") == "1") {
+		run_streaming_handler(handler_fn);
+	} else {
+		aws::lambda_runtime::run_handler([&](invocation_request const& req) { return handler_fn(req, nullptr); });
+	}
+	return 0;
+}
@@ -0,0 +1,426 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "engine/mc_engine.h"
+
+using namespace std;
+using namespace mc;
+
+// Convergence and accuracy benchmark: prices contracts with known Black-Scholes values in
+// every engine mode, over independent seeded replications, and reports per mode, contract
+// and path count
+//
+//   bias        mean MC price - closed form
+//   stderr      mean standard error the engine reports for one run
+//   rmse        root mean squared error against the closed form
+//   time        wall time of one run
+//   efficiency  stderr^2 * time; lower is better, and comparable between modes since it
+//               does not depend on the path count
+//
+// A |bias| of more than 4 standard errors of the replication mean is flagged, as that is
+// what a kernel or RNG change that skews prices looks like. --products also prices the
+// composite and digital payoffs of engine/payoffs.h on the sim contract, at --max_paths,
+// against their closed forms.
+//
+// The engine modes run at the --isa level, and again at each kernel level the CPU supports
+// (engine-avx2, engine-float-avx512, ...), so SIMD variants are compared on one report.
+//
+// --determinism checks that seeded prices do not depend on how they are computed: the sim
+// contract, at --max_paths plus a partial block, priced split over 1 to 64 workers, in a
+// price_shared() batch and serially, with metrics off and on, must come out the same to the
+// bit in each precision. Any difference fails the run.
+//
+//   mcaccuracy [--grid=sim|full] [--replications=<n>] [--max_paths=<n>] [--threads=<n>]
+//              [--mode=<name>] [--products] [--determinism] [--isa=<level>] [--out=<file.json>]
+
+static double norm_cdf(double x) {
+  return 0.5 * erfc(-x / sqrt(2.0));
+}
+
+struct ClosedForm {
+  double call;
+  double put;
+};
+
+static ClosedForm black_scholes(Contract const& c) {
+  double sqrt_T = sqrt(c.T);
+  double d1 = (log(c.S / c.K) + (c.r + 0.5 * c.v * c.v) * c.T) / (c.v * sqrt_T);
+  double d2 = d1 - c.v * sqrt_T;
+  double discounted_K = c.K * exp(-c.r * c.T);
+  return ClosedForm{c.S * norm_cdf(d1) - discounted_K * norm_cdf(d2), discounted_K * norm_cdf(-d2) - c.S * norm_cdf(-d1)};
+}
+
+// cash-or-nothing digitals pay cash * N(+-d2), discounted
+static ClosedForm black_scholes_digital(Contract const& c, double cash) {
+  double sqrt_T = sqrt(c.T);
+  double d2 = (log(c.S / c.K) + (c.r - 0.5 * c.v * c.v) * c.T) / (c.v * sqrt_T);
+  double discounted_cash = cash * exp(-c.r * c.T);
+  return ClosedForm{discounted_cash * norm_cdf(d2), discounted_cash * norm_cdf(-d2)};
+}
+
+static Contract with_strike(Contract c, double K) {
+  c.K = K;
+  return c;
+}
+
+// A product of engine/payoffs.h, its closed form and how to price it in a precision.
+struct ProductCheck {
+  const char* name;
+  double exact;
+  function<PayoffPrice(Contract const&, Precision)> price;
+};
+
+// An engine configuration to compare. Every mode prices the same seeded contracts.
+struct AccuracyMode {
+  string name;
+  function<PricingResult(Contract const&, unsigned long long seed)> price;
+};
+
+struct Statistics {
+  double bias;
+  double stderr_mean;
+  double rmse;
+  double seconds;
+  double efficiency;
+  bool biased;
+};
+
+static Statistics statistics(vector<double> const& prices, vector<double> const& stderrs, double exact, double seconds) {
+  double n = static_cast<double>(prices.size());
+  double mean = 0.0, squared_error = 0.0, stderr_sum = 0.0;
+  for (size_t i = 0; i < prices.size(); i++) {
+    mean += prices[i];
+    squared_error += (prices[i] - exact) * (prices[i] - exact);
+    stderr_sum += stderrs[i];
+  }
+  mean /= n;
+
+  Statistics s;
+  s.bias = mean - exact;
+  s.stderr_mean = stderr_sum / n;
+  s.rmse = sqrt(squared_error / n);
+  s.seconds = seconds / n;
+  s.efficiency = s.stderr_mean * s.stderr_mean * s.seconds;
+  s.biased = s.stderr_mean > 0.0 && fabs(s.bias) > 4.0 * s.stderr_mean / sqrt(n);  // no paths in the money: nothing to test
+  return s;
+}
+
+struct AccuracyRow {
+  string mode;
+  Contract contract;
+  const char* option;
+  double exact;
+  Statistics stats;
+};
+
+static bool flag_value(const char* arg, const char* name, string& value) {
+  size_t n = strlen(name);
+  if (strncmp(arg, name, n) == 0 && arg[n] == '=') {
+    value = arg + n + 1;
+    return true;
+  }
+  return false;
+}
+
+static bool write_json(string const& path, vector<AccuracyRow> const& rows) {
+  ofstream out(path);
+  out.precision(10);
+  out << "{\n  \"results\": [";
+  for (size_t i = 0; i < rows.size(); i++) {
+    AccuracyRow const& row = rows[i];
+    Contract const& c = row.contract;
+    out << (i ? "," : "") << "\n    {\"mode\": \"" << row.mode << "\", \"option\": \"" << row.option << "\""
+        << ", \"paths\": " << c.num_sims << ", \"S\": " << c.S << ", \"K\": " << c.K << ", \"r\": " << c.r
+        << ", \"v\": " << c.v << ", \"T\": " << c.T << ", \"exact\": " << row.exact
+        << ", \"bias\": " << row.stats.bias << ", \"stderr\": " << row.stats.stderr_mean
+        << ", \"rmse\": " << row.stats.rmse << ", \"seconds\": " << row.stats.seconds
+        << ", \"efficiency\": " << row.stats.efficiency << ", \"biased\": " << (row.stats.biased ? "true" : "false") << "}";
+  }
+  out << "\n  ]\n}\n";
+  return static_cast<bool>(out);
+}
+
+static bool same_bits(PricingResult const& a, PricingResult const& b) {
+  const double x[] = { a.call, a.put, a.call_stderr, a.put_stderr };
+  const double y[] = { b.call, b.put, b.call_stderr, b.put_stderr };
+  return memcmp(x, y, sizeof(x)) == 0;
+}
+
+// Prices c seeded in every way the drivers do and returns the number of results that
+// differ from the first of their precision.
+static int check_determinism(Contract const& c) {
+  const unsigned long long seed = 7;
+  bool metrics = metrics_enabled();
+  int differing = 0;
+  printf("\n%-18s %10s %6s %8s %24s\n", "mode", "paths", "runs", "differ", "call");
+  for (Precision precision : {Precision::Double, Precision::Float, Precision::FloatKahan}) {
+    string name = precision == Precision::Double ? "engine" : string("engine-") + precision_name(precision);
+    vector<pair<string, PricingResult>> runs;
+    for (bool timed : {false, true}) {
+      set_metrics_enabled(timed);
+      string suffix = timed ? "/metrics" : "";
+      for (unsigned threads : {1u, 2u, 3u, 8u, 64u}) {
+        EngineContext engine(threads);
+        engine.seed(seed);
+        runs.push_back(make_pair("price/threads:" + to_string(threads) + suffix, price(engine, c, precision)));
+        Contract batch[2] = { c, c };
+        PricingResult shared[2];
+        engine.seed(seed);
+        price_shared(engine, batch, 2, shared, precision);
+        runs.push_back(make_pair("shared/threads:" + to_string(threads) + suffix, shared[1]));
+      }
+      WorkerState state(0);
+      state.seed(seed, 0);
+      runs.push_back(make_pair("serial" + suffix, price_serial(state, c, precision)));
+    }
+
+    int differ = 0;
+    for (auto const& run : runs) {
+      if (!same_bits(run.second, runs[0].second)) {
+        printf("%-18s %s: call %a put %a, expected %a %a\n", name.c_str(), run.first.c_str(), run.second.call, run.second.put,
+               runs[0].second.call, runs[0].second.put);
+        differ++;
+      }
+    }
+    printf("%-18s %10d %6zu %8d %24a\n", name.c_str(), c.num_sims, runs.size(), differ, runs[0].second.call);
+    differing += differ;
+  }
+  set_metrics_enabled(metrics);
+  return differing;
+}
+
+int main(int argc, char **argv) {
+  string grid = "sim";
+  string mode_filter;
+  string out_path;
+  bool products = false;
+  bool determinism = false;
+  int replications = 16;
+  long max_paths = 1000000;
+  unsigned threads = detect_available_cpus();
+
+  for (int i = 1; i < argc; i++) {
+    string value;
+    if (flag_value(argv[i], "--grid", value)) {
+      grid = value;
+    } else if (flag_value(argv[i], "--replications", value)) {
+      replications = max(2, atoi(value.c_str()));
+    } else if (flag_value(argv[i], "--max_paths", value)) {
+      max_paths = min(static_cast<long>(atof(value.c_str())), 2000000000L);
+    } else if (flag_value(argv[i], "--threads", value)) {
+      threads = static_cast<unsigned>(max(1, atoi(value.c_str())));
+    } else if (flag_value(argv[i], "--isa", value)) {
+      Isa isa;
+      if (!isa_from_string(value, isa) || !set_isa(isa)) {
+        cerr << "Kernel level " << value << " is unknown or not supported by this CPU (sse2, avx2, avx512)\n";
+        return -1;
+      }
+    } else if (flag_value(argv[i], "--mode", value)) {
+      mode_filter = value;
+    } else if (strcmp(argv[i], "--products") == 0) {
+      products = true;
+    } else if (strcmp(argv[i], "--determinism") == 0) {
+      determinism = true;
+    } else if (flag_value(argv[i], "--out", value)) {
+      out_path = value;
+    } else {
+      cerr << "Unknown argument " << argv[i] << "\n"
+           << "Usage: mcaccuracy [--grid=sim|full] [--replications=<n>] [--max_paths=<n>] [--threads=<n>] [--mode=<name>] [--products] [--determinism] [--isa=sse2|avx2|avx512] [--out=<file.json>]\n";
+      return -1;
+    }
+  }
+
+  //the sim CLI parameter set first, then a grid over moneyness, volatility and maturity
+  vector<Contract> contracts{Contract{0, 100.0, 100.0, 0.05, 0.2, 1.0}};
+  if (grid == "full") {
+    for (double S : {80.0, 100.0, 120.0}) {
+      for (double v : {0.1, 0.4}) {
+        for (double T : {0.25, 2.0}) {
+          contracts.push_back(Contract{0, S, 100.0, 0.05, v, T});
+        }
+      }
+    }
+  }
+
+  EngineContext engine(threads);
+  WorkerState serial_state(0);
+
+  vector<AccuracyMode> modes{
+    {"serial", [&](Contract const& c, unsigned long long seed) {
+      serial_state.seed(seed, 0);
+      return price_serial(serial_state, c);
+    }},
+  };
+  for (Precision precision : {Precision::Double, Precision::Float, Precision::FloatKahan}) {
+    string name = precision == Precision::Double ? "engine" : string("engine-") + precision_name(precision);
+    modes.push_back(AccuracyMode{name, [&engine, precision](Contract const& c, unsigned long long seed) {
+      engine.seed(seed);
+      return price(engine, c, precision);
+    }});
+  }
+  // and at every kernel level this CPU supports, whatever --isa picked, so the SIMD variants
+  // are compared on the same efficiency; the level is set for each run and put back after it
+  for (Isa isa : {Isa::SSE2, Isa::AVX2, Isa::AVX512}) {
+    if (!isa_supported(isa)) {
+      continue;
+    }
+    for (Precision precision : {Precision::Double, Precision::Float, Precision::FloatKahan}) {
+      string name = precision == Precision::Double ? "engine-" : string("engine-") + precision_name(precision) + "-";
+      modes.push_back(AccuracyMode{name + isa_name(isa), [&engine, precision, isa](Contract const& c, unsigned long long seed) {
+        Isa previous = active_isa();
+        set_isa(isa);
+        engine.seed(seed);
+        PricingResult result = price(engine, c, precision);
+        set_isa(previous);
+        return result;
+      }});
+    }
+  }
+
+  printf("%-26s %6s %6s %5s %5s %10s %4s %10s %11s %10s %10s %10s %11s\n",
+         "mode", "S", "K", "v", "T", "paths", "opt", "exact", "bias", "stderr", "rmse", "time(ms)", "efficiency");
+
+  vector<AccuracyRow> rows;
+  for (AccuracyMode const& mode : modes) {
+    if (!mode_filter.empty() && mode_filter != mode.name) {
+      continue;
+    }
+    for (Contract contract : contracts) {
+      ClosedForm exact = black_scholes(contract);
+
+      for (long paths = 10000; paths <= max_paths; paths *= 10) {
+        contract.num_sims = static_cast<int>(paths);
+        vector<double> calls, puts, call_stderrs, put_stderrs;
+        double seconds = 0.0;
+
+        for (int rep = 0; rep < replications; rep++) {
+          auto start = chrono::steady_clock::now();
+          PricingResult result = mode.price(contract, 1000003ULL * static_cast<unsigned long long>(rep + 1));
+          seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+          calls.push_back(result.call);
+          puts.push_back(result.put);
+          call_stderrs.push_back(result.call_stderr);
+          put_stderrs.push_back(result.put_stderr);
+        }
+
+        rows.push_back(AccuracyRow{mode.name, contract, "call", exact.call, statistics(calls, call_stderrs, exact.call, seconds)});
+        rows.push_back(AccuracyRow{mode.name, contract, "put", exact.put, statistics(puts, put_stderrs, exact.put, seconds)});
+
+        for (size_t i = rows.size() - 2; i < rows.size(); i++) {
+          AccuracyRow const& row = rows[i];
+          printf("%-26s %6.1f %6.1f %5.2f %5.2f %10d %4s %10.5f %+11.6f %10.6f %10.6f %10.3f %11.4g%s\n",
+                 row.mode.c_str(), contract.S, contract.K, contract.v, contract.T, contract.num_sims, row.option, row.exact,
+                 row.stats.bias, row.stats.stderr_mean, row.stats.rmse, row.stats.seconds * 1e3, row.stats.efficiency,
+                 row.stats.biased ? "  BIASED" : "");
+        }
+        fflush(stdout);
+      }
+    }
+  }
+
+  // per mode: worst bias in standard errors of the replication mean, and mean efficiency
+  // relative to the first mode at the largest path count
+  printf("\n%-26s %16s %22s\n", "mode", "max |bias|/se", "efficiency vs first");
+  double baseline = 0.0;
+  for (AccuracyMode const& mode : modes) {
+    double worst = 0.0, log_efficiency = 0.0;
+    int largest = 0;
+    for (AccuracyRow const& row : rows) {
+      if (row.mode != mode.name || row.stats.stderr_mean <= 0.0) {
+        continue;
+      }
+      worst = max(worst, fabs(row.stats.bias) / (row.stats.stderr_mean / sqrt(static_cast<double>(replications))));
+      if (row.contract.num_sims * 10L > max_paths && row.stats.efficiency > 0.0) {
+        log_efficiency += log(row.stats.efficiency);
+        largest++;
+      }
+    }
+    if (largest == 0) {
+      continue;
+    }
+    double efficiency = exp(log_efficiency / largest);
+    if (baseline == 0.0) {
+      baseline = efficiency;
+    }
+    printf("%-26s %16.2f %22.3f\n", mode.name.c_str(), worst, efficiency / baseline);
+  }
+
+  if (products) {
+    Contract c = contracts[0];
+    c.num_sims = static_cast<int>(max_paths);
+    const double K1 = 90.0, K2 = 110.0, cash = 10.0;
+    ClosedForm at = black_scholes(c), low = black_scholes(with_strike(c, K1)), high = black_scholes(with_strike(c, K2));
+    ClosedForm digital = black_scholes_digital(c, cash);
+
+    vector<ProductCheck> checks{
+      {"digital-call", digital.call, [&](Contract const& x, Precision p) { return price_payoff(engine, x, DigitalCallPayoff(c.K, cash), p); }},
+      {"digital-put", digital.put, [&](Contract const& x, Precision p) { return price_payoff(engine, x, DigitalPutPayoff(c.K, cash), p); }},
+      {"straddle", at.call + at.put, [&](Contract const& x, Precision p) {
+        return price_payoff(engine, x, Straddle(CallPayoff(c.K), PutPayoff(c.K)), p);
+      }},
+      {"strangle", low.put + high.call, [&](Contract const& x, Precision p) {
+        return price_payoff(engine, x, Strangle(PutPayoff(K1), CallPayoff(K2)), p);
+      }},
+      {"call-spread", low.call - high.call, [&](Contract const& x, Precision p) {
+        return price_payoff(engine, x, CallSpread(CallPayoff(K1), CallPayoff(K2)), p);
+      }},
+      {"put-spread", high.put - low.put, [&](Contract const& x, Precision p) {
+        return price_payoff(engine, x, PutSpread(PutPayoff(K2), PutPayoff(K1)), p);
+      }},
+    };
+
+    printf("\n%-18s %-13s %10d paths %10s %11s %10s %10s %10s\n", "mode", "product", c.num_sims, "exact", "bias", "stderr", "rmse", "time(ms)");
+    for (Precision precision : {Precision::Double, Precision::Float, Precision::FloatKahan}) {
+      string name = precision == Precision::Double ? "engine" : string("engine-") + precision_name(precision);
+      if (!mode_filter.empty() && mode_filter != name) {
+        continue;
+      }
+      for (ProductCheck const& check : checks) {
+        vector<double> prices, stderrs;
+        double seconds = 0.0;
+        for (int rep = 0; rep < replications; rep++) {
+          engine.seed(1000003ULL * static_cast<unsigned long long>(rep + 1));
+          auto start = chrono::steady_clock::now();
+          PayoffPrice result = check.price(c, precision);
+          seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+          prices.push_back(result.price);
+          stderrs.push_back(result.standard_error);
+        }
+        rows.push_back(AccuracyRow{name, c, check.name, check.exact, statistics(prices, stderrs, check.exact, seconds)});
+        Statistics const& stats = rows.back().stats;
+        printf("%-18s %-13s %16s %10.5f %+11.6f %10.6f %10.6f %10.3f%s\n", name.c_str(), check.name, "", check.exact,
+               stats.bias, stats.stderr_mean, stats.rmse, stats.seconds * 1e3, stats.biased ? "  BIASED" : "");
+      }
+    }
+  }
+
+  int biased = 0;
+  for (AccuracyRow const& row : rows) {
+    biased += row.stats.biased ? 1 : 0;
+  }
+  printf("\n%d of %zu estimates biased beyond 4 standard errors\n", biased, rows.size());
+
+  int differing = 0;
+  if (determinism) {
+    Contract c = contracts[0];
+    c.num_sims = static_cast<int>(max_paths) + 3;
+    differing = check_determinism(c);
+    printf("\n%d seeded results depend on how they were computed\n", differing);
+  }
+
+  if (!out_path.empty() && !write_json(out_path, rows)) {
+    cerr << "Cannot write " << out_path << "\n";
+    return 1;
+  }
+  return differing > 0 ? 1 : 0;
+}
@@ -0,0 +1,441 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <regex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "engine/json_request.h"
+#include "engine/kernels.h"
+#include "engine/mc_engine.h"
+
+using namespace std;
+using namespace mc;
+
+// Microbenchmarks for the pricing kernels, in the style of Google Benchmark: every benchmark
+// is repeated until it has run for at least --benchmark_min_time seconds and is reported per
+// iteration and per item (normal, path, element, contract). End-to-end runs additionally
+// report the scaling efficiency against the single-threaded run with the same path count. With
+// --perf_counters (or PERF_COUNTERS=1) hardware counters per item are reported as well,
+// summed over all workers for end-to-end runs.
+//
+//   mcbench [--benchmark_filter=<regex>] [--benchmark_min_time=<s>] [--benchmark_out=<file.json>]
+//           [--max_paths=<n>] [--max_threads=<n>] [--precision=<p>] [--isa=<level>] [--perf_counters]
+//           [--count_allocations]
+//
+// End-to-end runs take 10^5 paths up to --max_paths (default 10^9) in powers of ten. A
+// 10^9-path run takes tens of seconds per thread count, about 45 s on one core of an AVX-512
+// machine; --max_paths=100000000 gives a run of a few seconds.
+//
+// --precision selects the path precision of the end-to-end runs, --isa the kernel level
+// (default: the best this CPU supports). --count_allocations counts heap allocations per
+// iteration on every thread. End-to-end runs reuse a warmed-up engine and must not allocate
+// at all; mcbench lists those that do and exits with status 1.
+
+// operator new of the whole process, counted while allocation_counting is set
+static atomic<bool> allocation_counting{false};
+static atomic<uint64_t> allocation_count{0};
+
+// both kept out of line, so GCC does not pair malloc() and free() with new and delete
+// expressions at the call sites
+__attribute__((noinline)) void* operator new(size_t size) {
+  if (allocation_counting.load(memory_order_relaxed)) {
+    allocation_count.fetch_add(1, memory_order_relaxed);
+  }
+  void* p = malloc(size ? size : 1);
+  if (!p) {
+    throw bad_alloc();
+  }
+  return p;
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+  free(p);
+}
+
+struct BenchmarkResult {
+  string name;
+  long iterations;
+  double seconds;              // wall time over all iterations
+  double items_per_iteration;  // normals, paths, elements or contracts per iteration
+  unsigned threads;
+  double scaling_efficiency;   // end-to-end only, negative otherwise
+  PerfSample perf;             // over all iterations of the final timing round
+  double allocations;          // heap allocations per iteration of that round, negative if not counted
+
+  double ns_per_iteration() const { return seconds * 1e9 / static_cast<double>(iterations); }
+  double ns_per_item() const { return ns_per_iteration() / items_per_iteration; }
+  double items_per_second() const { return items_per_iteration * static_cast<double>(iterations) / seconds; }
+};
+
+// keeps benchmarked results observable so the compiler cannot drop the work
+static volatile double benchmark_sink;
+
+// Hardware counters for one timing round: begin() before it, end() after it.
+struct CounterProbe {
+  function<void()> begin;
+  function<PerfSample()> end;
+};
+
+class BenchmarkRunner {
+  private:
+    double _min_time;
+    regex _filter;
+    vector<BenchmarkResult> _results;
+
+  public:
+    BenchmarkRunner(double min_time, string const& filter) : _min_time(min_time), _filter(filter) {}
+
+    vector<BenchmarkResult> const& results() const {
+      return _results;
+    }
+
+    bool selected(string const& name) const {
+      return regex_search(name, _filter);
+    }
+
+    // Times fn() and returns the recorded result, or nullptr when filtered out.
+    template <class Fn>
+    BenchmarkResult* run(string const& name, double items, unsigned threads, bool warmup, Fn fn, CounterProbe const* probe = nullptr) {
+      if (!selected(name)) {
+        return nullptr;
+      }
+      if (warmup) {
+        fn();
+      }
+
+      long iterations = 1;
+      for (;;) {
+        if (probe) {
+          probe->begin();
+        }
+        uint64_t allocations = allocation_count.load();
+        auto start = chrono::steady_clock::now();
+        for (long i = 0; i < iterations; i++) {
+          fn();
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        allocations = allocation_count.load() - allocations;
+
+        if (seconds >= _min_time || iterations >= 1000000000L) {
+          double per_iteration = allocation_counting ? static_cast<double>(allocations) / static_cast<double>(iterations) : -1.0;
+          _results.push_back(BenchmarkResult{name, iterations, seconds, items, threads, -1.0, PerfSample(), per_iteration});
+          if (probe) {
+            _results.back().perf = probe->end();
+          }
+          print(_results.back());
+          return &_results.back();
+        }
+        double scale = seconds > 0.0 ? _min_time * 1.4 / seconds : 100.0;
+        iterations = max(iterations + 1, static_cast<long>(static_cast<double>(iterations) * min(scale, 100.0)));
+      }
+    }
+
+    static void print_header() {
+      printf("%-44s %16s %12s %12s %16s\n", "Benchmark", "Time/iter (ns)", "Iterations", "ns/item", "items/s");
+      printf("%s\n", string(104, '-').c_str());
+    }
+
+    static void print(BenchmarkResult const& r) {
+      printf("%-44s %16.0f %12ld %12.3f %16.4g\n", r.name.c_str(), r.ns_per_iteration(), r.iterations, r.ns_per_item(), r.items_per_second());
+      if (r.perf.any()) {
+        double items = r.items_per_iteration * static_cast<double>(r.iterations);
+        printf("%-44s", "");
+        for (int e = 0; e < PERF_EVENT_COUNT; e++) {
+          if (r.perf.valid[e]) {
+            printf(" %s/item=%.3g", perf_event_name(e), static_cast<double>(r.perf.values[e]) / items);
+          }
+        }
+        printf(" ipc=%.2f\n", r.perf.ipc());
+      }
+      if (r.allocations >= 0.0) {
+        printf("%-44s allocations/iter=%.3g\n", "", r.allocations);
+      }
+      fflush(stdout);
+    }
+
+    bool write_json(string const& path) const {
+      ofstream out(path);
+      if (!out) {
+        return false;
+      }
+      time_t now = time(nullptr);
+      char date[32];
+      strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+
+      out.precision(10);
+      out << "{\n  \"context\": {\n"
+          << "    \"date\": \"" << date << "\",\n"
+          << "    \"available_cpus\": " << detect_available_cpus() << ",\n"
+          << "    \"hardware_concurrency\": " << thread::hardware_concurrency() << ",\n"
+          << "    \"path_chunk\": " << PATH_CHUNK << ",\n"
+          << "    \"isa\": \"" << isa_name(active_isa()) << "\"\n"
+          << "  },\n  \"benchmarks\": [";
+      for (size_t i = 0; i < _results.size(); i++) {
+        BenchmarkResult const& r = _results[i];
+        out << (i ? "," : "") << "\n    {\"name\": \"" << r.name << "\""
+            << ", \"iterations\": " << r.iterations
+            << ", \"real_time_ns\": " << r.ns_per_iteration()
+            << ", \"ns_per_item\": " << r.ns_per_item()
+            << ", \"items_per_second\": " << r.items_per_second()
+            << ", \"threads\": " << r.threads;
+        if (r.scaling_efficiency >= 0.0) {
+          out << ", \"scaling_efficiency\": " << r.scaling_efficiency;
+        }
+        if (r.allocations >= 0.0) {
+          out << ", \"allocations_per_iteration\": " << r.allocations;
+        }
+        if (r.perf.any()) {
+          // per iteration, like the timings
+          out << ", \"counters\": {";
+          for (int e = 0; e < PERF_EVENT_COUNT; e++) {
+            if (r.perf.valid[e]) {
+              out << "\"" << perf_event_name(e) << "\": " << static_cast<double>(r.perf.values[e]) / static_cast<double>(r.iterations) << ", ";
+            }
+          }
+          out << "\"ipc\": " << r.perf.ipc() << "}";
+        }
+        out << "}";
+      }
+      out << "\n  ]\n}\n";
+      return static_cast<bool>(out);
+    }
+};
+
+static bool flag_value(const char* arg, const char* name, string& value) {
+  size_t n = strlen(name);
+  if (strncmp(arg, name, n) == 0 && arg[n] == '=') {
+    value = arg + n + 1;
+    return true;
+  }
+  return false;
+}
+
+int main(int argc, char **argv) {
+  string filter = ".";
+  string out_path;
+  double min_time = 0.5;
+  long max_paths = 1000000000L;
+  unsigned max_threads = detect_available_cpus();
+  bool count_perf = perf_counters_from_env();
+  Precision precision = Precision::Double;
+
+  for (int i = 1; i < argc; i++) {
+    string value;
+    if (flag_value(argv[i], "--benchmark_filter", value)) {
+      filter = value;
+    } else if (flag_value(argv[i], "--benchmark_min_time", value)) {
+      min_time = atof(value.c_str());
+    } else if (flag_value(argv[i], "--benchmark_out", value)) {
+      out_path = value;
+    } else if (flag_value(argv[i], "--max_paths", value)) {
+      max_paths = static_cast<long>(atof(value.c_str()));
+    } else if (flag_value(argv[i], "--precision", value)) {
+      if (!precision_from_string(value, precision)) {
+        cerr << "Unknown precision " << value << "\n";
+        return -1;
+      }
+    } else if (flag_value(argv[i], "--isa", value)) {
+      Isa isa;
+      if (!isa_from_string(value, isa) || !set_isa(isa)) {
+        cerr << "Kernel level " << value << " is unknown or not supported by this CPU (sse2, avx2, avx512)\n";
+        return -1;
+      }
+    } else if (flag_value(argv[i], "--max_threads", value)) {
+      max_threads = static_cast<unsigned>(max(1, atoi(value.c_str())));
+    } else if (strcmp(argv[i], "--perf_counters") == 0) {
+      count_perf = true;
+    } else if (strcmp(argv[i], "--count_allocations") == 0) {
+      allocation_counting = true;
+    } else {
+      cerr << "Unknown argument " << argv[i] << "\n"
+           << "Usage: mcbench [--benchmark_filter=<regex>] [--benchmark_min_time=<s>] [--benchmark_out=<file.json>]"
+           << " [--max_paths=<n>] [--max_threads=<n>] [--precision=double|float|float-kahan] [--isa=sse2|avx2|avx512] [--perf_counters] [--count_allocations]\n";
+      return -1;
+    }
+  }
+  if (max_paths > 2000000000L) {
+    max_paths = 2000000000L;  // path counts are int
+  }
+
+  //parameter set of the sim CLI
+  const Contract contract{PATH_CHUNK, 100.0, 100.0, 0.05, 0.2, 1.0};
+  const PathParams params(contract);
+
+  BenchmarkRunner runner(min_time, filter);
+  printf("Kernels: %s (detected %s)\n", isa_name(active_isa()), isa_name(detect_isa()));
+  BenchmarkRunner::print_header();
+
+  // kernel benchmarks run on this thread, so its own counters cover them
+  unique_ptr<PerfCounters> counters(count_perf ? new PerfCounters() : nullptr);
+  if (counters && !counters->available()) {
+    printf("Hardware performance counters unavailable\n");
+  }
+  CounterProbe thread_probe{[&] { counters->start(); }, [&] { return counters->stop(); }};
+  const CounterProbe* kernel_probe = counters ? &thread_probe : nullptr;
+
+  WorkerState state(12345);
+  vector<double> gauss(PATH_CHUNK);
+  vector<double> S_T(PATH_CHUNK);
+  draw_normals(state, gauss.data(), PATH_CHUNK);
+  terminal_prices(gauss.data(), PATH_CHUNK, params, S_T.data());
+
+  // RNG: raw 32-bit draws and the normal generator the engine uses
+  runner.run("rng/mt19937", PATH_CHUNK, 1, true, [&] {
+    unsigned long acc = 0;
+    for (int i = 0; i < PATH_CHUNK; i++) {
+      acc += state.gen();
+    }
+    benchmark_sink = static_cast<double>(acc);
+  }, kernel_probe);
+  runner.run("rng/normal_distribution", PATH_CHUNK, 1, true, [&] {
+    draw_normals(state, gauss.data(), PATH_CHUNK);
+    benchmark_sink = gauss[0];
+  }, kernel_probe);
+
+  // kernels over one chunk held in L1
+  runner.run("kernel/terminal_price", PATH_CHUNK, 1, true, [&] {
+    terminal_prices(gauss.data(), PATH_CHUNK, params, S_T.data());
+    benchmark_sink = S_T[0];
+  }, kernel_probe);
+  runner.run("kernel/payoffs_from_terminal", PATH_CHUNK, 1, true, [&] {
+    PayoffSums sums = payoff_sums_terminal(S_T.data(), PATH_CHUNK, params.K);
+    benchmark_sink = sums.call + sums.put;
+  }, kernel_probe);
+  runner.run("kernel/fused_evolve_payoffs", PATH_CHUNK, 1, true, [&] {
+    PayoffSums sums = payoff_sums(gauss.data(), PATH_CHUNK, params);
+    benchmark_sink = sums.call + sums.put;
+  }, kernel_probe);
+  runner.run("kernel/reduction", PATH_CHUNK, 1, true, [&] {
+    benchmark_sink = sum(S_T.data(), PATH_CHUNK);
+  }, kernel_probe);
+
+  // float paths: twice the SIMD width, and one 32-bit draw per uniform instead of two
+  vector<float> gauss_f(PATH_CHUNK);
+  vector<float> S_T_f(PATH_CHUNK);
+  draw_normals(state, gauss_f.data(), PATH_CHUNK);
+  terminal_prices(gauss_f.data(), PATH_CHUNK, params, S_T_f.data());
+
+  runner.run("rng/normal_distribution_float", PATH_CHUNK, 1, true, [&] {
+    draw_normals(state, gauss_f.data(), PATH_CHUNK);
+    benchmark_sink = gauss_f[0];
+  }, kernel_probe);
+  runner.run("kernel/terminal_price_float", PATH_CHUNK, 1, true, [&] {
+    terminal_prices(gauss_f.data(), PATH_CHUNK, params, S_T_f.data());
+    benchmark_sink = S_T_f[0];
+  }, kernel_probe);
+  runner.run("kernel/fused_evolve_payoffs_float", PATH_CHUNK, 1, true, [&] {
+    PayoffSums sums = payoff_sums(gauss_f.data(), PATH_CHUNK, params);
+    benchmark_sink = sums.call + sums.put;
+  }, kernel_probe);
+  runner.run("kernel/payoffs_kahan_float", PATH_CHUNK, 1, true, [&] {
+    PayoffSums sums = payoff_sums_terminal_kahan(S_T_f.data(), PATH_CHUNK, static_cast<float>(params.K));
+    benchmark_sink = sums.call + sums.put;
+  }, kernel_probe);
+
+  // a 10^4 contract batch request, decoded into a reused batch as the Lambda function does
+  const int request_contracts = 10000;
+  string request = "{\"contracts\": [";
+  for (int i = 0; i < request_contracts; i++) {
+    request += (i ? ", " : "") + string("{\"numberOfPaths\": 100000, \"underlyingPrice\": ") + to_string(90 + i % 20) +
+               ", \"strikePrice\": 100, \"volatility\": 0.2" + (i % 2 ? "" : ", \"seed\": " + to_string(i)) + "}";
+  }
+  request += "], \"precision\": \"float\", \"seed\": 1}";
+  ContractBatch request_batch;
+  runner.run("parse/json_request", request_contracts, 1, true, [&] {
+    request_batch.clear();
+    JsonRequest parsed;
+    parse_json_request(request.data(), request.data() + request.size(), request_batch, parsed);
+    benchmark_sink = request_batch.contracts.back().S;
+  }, kernel_probe);
+
+  // end to end, 10^5 paths upwards, 1 to max_threads workers in powers of two
+  vector<unsigned> thread_counts;
+  for (unsigned t = 1; t < max_threads; t *= 2) {
+    thread_counts.push_back(t);
+  }
+  thread_counts.push_back(max_threads);
+
+  vector<long> path_counts;
+  for (long paths = 100000; paths <= max_paths; paths *= 10) {
+    path_counts.push_back(paths);
+  }
+
+  // ns/path of the single-threaded run per path count, for the efficiency column
+  vector<double> single_thread_ns(path_counts.size(), 0.0);
+
+  for (unsigned threads : thread_counts) {
+    // a reproducible start, then the worker streams as they stand, as unseeded requests run
+    EngineContext engine(threads);
+    engine.seed(42);
+    engine.unseed();
+
+    // summed over the workers of every run in the timing round
+    PerfSample round_perf;
+    CounterProbe engine_probe{[&] { round_perf = PerfSample(); }, [&] { return round_perf; }};
+    if (count_perf) {
+      engine.enable_perf_counters();
+    }
+
+    for (size_t p = 0; p < path_counts.size(); p++) {
+      Contract c = contract;
+      c.num_sims = static_cast<int>(path_counts[p]);
+      string name = "e2e/paths:" + to_string(path_counts[p]) + "/threads:" + to_string(threads);
+
+      BenchmarkResult* result = runner.run(name, static_cast<double>(c.num_sims), threads, c.num_sims < 10000000, [&] {
+        PricingResult priced = price(engine, c, precision);
+        benchmark_sink = priced.call;
+        if (count_perf) {
+          round_perf += engine.perf_total();
+        }
+      }, count_perf ? &engine_probe : nullptr);
+      if (!result) {
+        continue;
+      }
+      if (threads == 1) {
+        single_thread_ns[p] = result->ns_per_item();
+      }
+      if (single_thread_ns[p] > 0.0) {
+        result->scaling_efficiency = single_thread_ns[p] / (result->ns_per_item() * threads);
+        printf("%-44s %16s scaling efficiency %.2f\n", "", "", result->scaling_efficiency);
+      }
+    }
+
+    // seeded runs restart a stream per block and add the blocks up in a fixed tree, which
+    // is what makes them independent of the thread count; this is its cost
+    Contract seeded = contract;
+    seeded.num_sims = static_cast<int>(min(1000000L, max_paths));
+    engine.seed(42);
+    runner.run("e2e/seeded/paths:" + to_string(seeded.num_sims) + "/threads:" + to_string(threads), static_cast<double>(seeded.num_sims),
+               threads, true, [&] {
+      benchmark_sink = price(engine, seeded, precision).call;
+    });
+    engine.unseed();
+  }
+
+  if (!out_path.empty() && !runner.write_json(out_path)) {
+    cerr << "Cannot write " << out_path << "\n";
+    return 1;
+  }
+
+  // after warm-up, pricing runs entirely in the workers' arenas
+  int allocating = 0;
+  for (BenchmarkResult const& r : runner.results()) {
+    if (r.name.compare(0, 4, "e2e/") == 0 && r.allocations > 0.0) {
+      cerr << r.name << " allocates " << r.allocations << " times per run\n";
+      allocating++;
+    }
+  }
+  return allocating > 0 ? 1 : 0;
+}
@@ -0,0 +1,97 @@
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "engine/result_format.h"
+
+using namespace std;
+using namespace mc;
+
+// Prints a binary pricing result file (.mcr) as CSV, or its header only with --info.
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::cout << "Usage: mcread <result.mcr> [--info]\n";
+    return -1;
+  }
+  bool info_only = argc > 2 && string(argv[2]) == "--info";
+
+  int fd = open(argv[1], O_RDONLY);
+  if (fd < 0) {
+    perror(argv[1]);
+    return 1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    perror(argv[1]);
+    close(fd);
+    return 1;
+  }
+  size_t size = static_cast<size_t>(st.st_size);
+  void* data = size > 0 ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (data == MAP_FAILED) {
+    std::cerr << argv[1] << ": cannot map file\n";
+    return 1;
+  }
+
+  BinaryResultReader reader(static_cast<const char*>(data), size);
+  if (!reader.ok()) {
+    std::cerr << argv[1] << ": " << reader.error() << "\n";
+    munmap(data, size);
+    return 1;
+  }
+
+  if (info_only) {
+    cout << "Format version: " << reader.version() << "\n";
+    cout << "Created (ms):   " << reader.created_ms() << "\n";
+    for (auto const& kv : reader.metadata()) {
+      cout << kv.first << ": " << kv.second << "\n";
+    }
+    for (auto const& column : reader.columns()) {
+      cout << "column " << column.first << (column.second == RESULT_INT64 ? " int64" : " float64") << "\n";
+    }
+  }
+
+  uint64_t total_rows = 0;
+  if (!info_only) {
+    for (size_t c = 0; c < reader.columns().size(); c++) {
+      cout << (c ? "," : "") << reader.columns()[c].first;
+    }
+    cout << "\n";
+  }
+  cout.precision(17);
+
+  bool ok = reader.for_each_row_group([&](BinaryResultReader::RowGroup const& group) {
+    total_rows += group.rows;
+    if (info_only) {
+      return;
+    }
+    for (uint64_t i = 0; i < group.rows; i++) {
+      for (size_t c = 0; c < group.columns.size(); c++) {
+        uint64_t bits = get_le(group.columns[c] + 8 * i, 8);
+        if (c) {
+          cout << ",";
+        }
+        if (reader.columns()[c].second == RESULT_INT64) {
+          cout << static_cast<int64_t>(bits);
+        } else {
+          cout << bits_double(bits);
+        }
+      }
+      cout << "\n";
+    }
+  });
+
+  if (info_only) {
+    cout << "Rows:           " << total_rows << "\n";
+  }
+  if (!ok) {
+    std::cerr << argv[1] << ": " << reader.error() << "\n";
+  }
+  munmap(data, size);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,659 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <numeric>
+#include <poll.h>
+#include <sstream>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <tuple>
+#include <unistd.h>
+#include <vector>
+
+#include "engine/contract_input.h"
+#include "engine/json_request.h"
+#include "engine/mc_engine.h"
+
+using namespace std;
+using namespace mc;
+
+// Local pricing daemon: keeps one engine and its worker pool alive and prices requests
+// from other processes on a Unix domain socket, saving the process start and thread
+// creation of a sim run per request.
+//
+//   mcserver [--socket=<path>] [--threads=<n>] [--max_batch=<contracts>] [--batch_window_us=<us>]
+//            [--max_connections=<n>] [--isa=<level>]
+//
+// Every message is a frame: u32 payload length (little-endian), then the payload. A
+// payload starting with '{' is JSON, with the Lambda function's request schema:
+//
+//   {"numberOfPaths": 100000, "underlyingPrice": 100, "strikePrice": 100, "volatility": 0.2,
+//    "riskFreeRate": 0.5, "maturity": 1, "seed": 1, "precision": "double"}
+//   {"contracts": [{...}, ...], "seed": 1, "precision": "float"}
+//   {"stats": true}
+//
+// as read by engine/json_request.h: riskFreeRate and maturity default to 0.5 and 1, seed and
+// precision apply to the whole request or to one contract. The response is
+//
+//   {"results": [{"call": c, "put": p, "callStdErr": e, "putStdErr": e}, ...]}
+//   {"errorType": "InvalidJSON", "errorMessage": "..."}
+//
+// with errorType InvalidPrecision for an unknown precision name and InvalidJSON for any
+// other malformed request, as the Lambda function reports them, ServerStopping for a request
+// arriving during shutdown, or the server statistics for a stats request. Binary requests are
+//
+//   0   char[4]  magic "MCRQ"
+//   4   u16      version, 1
+//   6   u8       precision: 0 double, 1 float, 2 float-kahan
+//   7   u8       flags: 1 = seeded
+//   8   u64      seed
+//   16  u32      contract count
+//   20  u32      reserved, 0
+//   24  contract records in the format of engine/contract_input.h, 48 bytes each
+//
+// answered with "MCRS", u32 status (0 ok), u64 count, then per contract call, put and
+// their standard errors as f64, or after a non-zero status the error message.
+//
+// Requests are queued and the pricing thread takes them in micro-batches: it waits up to
+// --batch_window_us after the oldest queued request for others to arrive, or until
+// --max_batch contracts are queued. Contracts of a batch with the same path count,
+// precision and seed are priced together by price_shared(), drawing their normals once.
+// Seeded contracts price the same as with sim --seed, bit for bit, whatever they are
+// batched with and on any number of threads.
+
+static const uint32_t MAX_FRAME_SIZE = 64u << 20;
+static const size_t BINARY_REQUEST_HEADER_SIZE = 24;
+static const size_t LATENCY_WINDOW = 4096;  // latencies kept for the percentiles
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void on_signal(int) {
+  stop_requested = 1;
+}
+
+static bool flag_value(const char* arg, const char* name, string& value) {
+  size_t n = strlen(name);
+  if (strncmp(arg, name, n) == 0 && arg[n] == '=') {
+    value = arg + n + 1;
+    return true;
+  }
+  return false;
+}
+
+// -- framing -------------------------------------------------------------------------------
+
+static bool read_all(int fd, char* data, size_t size) {
+  while (size > 0) {
+    ssize_t n = read(fd, data, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    size -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+static bool write_all(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    size -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+static void put_u32(string& out, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+  }
+}
+
+static void put_u64(string& out, uint64_t value) {
+  for (int i = 0; i < 8; i++) {
+    out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+  }
+}
+
+static uint64_t get_le(const char* in, size_t bytes) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < bytes; i++) {
+    value |= static_cast<uint64_t>(static_cast<unsigned char>(in[i])) << (8 * i);
+  }
+  return value;
+}
+
+// false at the end of the connection or on a frame over MAX_FRAME_SIZE
+static bool read_frame(int fd, string& payload) {
+  char length[4];
+  if (!read_all(fd, length, 4)) {
+    return false;
+  }
+  uint32_t size = static_cast<uint32_t>(get_le(length, 4));
+  if (size > MAX_FRAME_SIZE) {
+    return false;
+  }
+  payload.resize(size);
+  return size == 0 || read_all(fd, &payload[0], size);
+}
+
+static bool write_frame(int fd, string const& payload) {
+  string frame;
+  frame.reserve(4 + payload.size());
+  put_u32(frame, static_cast<uint32_t>(payload.size()));
+  frame += payload;
+  return write_all(fd, frame.data(), frame.size());
+}
+
+// -- requests ------------------------------------------------------------------------------
+
+typedef std::chrono::steady_clock Clock;
+
+// One client request: its contracts with their settings, and once done their results.
+struct Request {
+  ContractBatch batch;
+  vector<PricingResult> results;
+  bool json = true;
+  bool done = false;
+  Clock::time_point enqueued;
+  Clock::time_point started;
+};
+
+static bool parse_binary_request(string const& payload, Request& request, string& error) {
+  const char* p = payload.data();
+  if (payload.size() < BINARY_REQUEST_HEADER_SIZE || memcmp(p, "MCRQ", 4) != 0 || get_le(p + 4, 2) != 1) {
+    error = "not a version 1 binary request";
+    return false;
+  }
+  uint8_t precision_code = static_cast<uint8_t>(p[6]);
+  if (precision_code > 2) {
+    error = "unknown precision " + to_string(precision_code);
+    return false;
+  }
+  Precision precision = static_cast<Precision>(precision_code);
+  bool seeded = (p[7] & 1) != 0;
+  unsigned long long seed = get_le(p + 8, 8);
+  uint64_t count = get_le(p + 16, 4);
+  if ((payload.size() - BINARY_REQUEST_HEADER_SIZE) != count * CONTRACT_RECORD_SIZE) {
+    error = "size does not match " + to_string(count) + " contracts";
+    return false;
+  }
+
+  request.json = false;
+  ContractCursor cursor(p + BINARY_REQUEST_HEADER_SIZE, p + payload.size(), true);
+  Contract contract;
+  while (cursor.next(contract)) {
+    request.batch.add(contract, precision, seeded, seed);
+  }
+  if (!cursor.at_end()) {
+    error = "contract " + to_string(request.batch.size()) + " is out of range";
+    return false;
+  }
+  return true;
+}
+
+// prices round-trip with 17 digits; statistics need fewer
+static string json_number(double value, int digits = 17) {
+  char text[32];
+  snprintf(text, sizeof(text), "%.*g", digits, value);
+  return text;
+}
+
+static string json_escape(string const& text) {
+  string out;
+  for (char c : text) {
+    if (c == '"' || c == '\\') {
+      out.push_back('\\');
+    }
+    out.push_back(static_cast<unsigned char>(c) < 0x20 ? ' ' : c);
+  }
+  return out;
+}
+
+static string json_error(string const& type, string const& message) {
+  return "{\"errorType\": \"" + type + "\", \"errorMessage\": \"" + json_escape(message) + "\"}";
+}
+
+static string binary_error(string const& message) {
+  string out("MCRS", 4);
+  put_u32(out, 1);
+  put_u64(out, 0);
+  return out + message;
+}
+
+static string encode_response(Request const& request) {
+  if (request.json) {
+    string out = "{\"results\": [";
+    for (size_t i = 0; i < request.results.size(); i++) {
+      PricingResult const& r = request.results[i];
+      out += (i ? ", " : "");
+      out += "{\"call\": " + json_number(r.call) + ", \"put\": " + json_number(r.put) +
+             ", \"callStdErr\": " + json_number(r.call_stderr) + ", \"putStdErr\": " + json_number(r.put_stderr) + "}";
+    }
+    return out + "]}";
+  }
+
+  string out("MCRS", 4);
+  put_u32(out, 0);
+  put_u64(out, request.results.size());
+  for (PricingResult const& r : request.results) {
+    for (double value : { r.call, r.put, r.call_stderr, r.put_stderr }) {
+      uint64_t bits;
+      memcpy(&bits, &value, sizeof(bits));
+      put_u64(out, bits);
+    }
+  }
+  return out;
+}
+
+// -- server --------------------------------------------------------------------------------
+
+// Latencies of the last LATENCY_WINDOW requests, in microseconds.
+class LatencyWindow {
+  private:
+    vector<double> _values;
+    size_t _next = 0;
+
+  public:
+    void add(double us) {
+      if (_values.size() < LATENCY_WINDOW) {
+        _values.push_back(us);
+      } else {
+        _values[_next] = us;
+      }
+      _next = (_next + 1) % LATENCY_WINDOW;
+    }
+
+    string percentiles_json() const {
+      vector<double> sorted(_values);
+      sort(sorted.begin(), sorted.end());
+      auto at = [&sorted](double q) {
+        return sorted.empty() ? 0.0 : sorted[min(sorted.size() - 1, static_cast<size_t>(q * static_cast<double>(sorted.size())))];
+      };
+      return "{\"p50\": " + json_number(at(0.5), 6) + ", \"p90\": " + json_number(at(0.9), 6) + ", \"p99\": " +
+             json_number(at(0.99), 6) + ", \"max\": " + json_number(sorted.empty() ? 0.0 : sorted.back(), 6) + "}";
+    }
+};
+
+class PricingServer {
+  private:
+    EngineContext& _engine;
+    size_t _max_batch;
+    std::chrono::microseconds _window;
+
+    std::mutex _mutex;
+    std::condition_variable _queued;
+    std::condition_variable _priced;
+    deque<Request*> _queue;
+    size_t _queued_contracts = 0;
+    bool _stopping = false;
+
+    // statistics, under _mutex
+    uint64_t _requests = 0;
+    uint64_t _contracts = 0;
+    uint64_t _batches = 0;
+    uint64_t _path_sets = 0;         // price_shared() calls, one set of normals each
+    size_t _max_queue_depth = 0;     // contracts
+    size_t _largest_batch = 0;
+    uint64_t _batch_sizes[16] = {};  // batches of [2^i, 2^(i+1)) contracts
+    LatencyWindow _latency;          // enqueue to response
+    LatencyWindow _queue_wait;       // enqueue to the start of its batch
+    Clock::time_point _started = Clock::now();
+
+    // Prices a batch: contracts with the same path count, precision and seed share paths.
+    void price_batch(vector<Request*> const& batch) {
+      struct Job {
+        Request* request;
+        size_t index;
+      };
+      vector<Job> jobs;
+      for (Request* request : batch) {
+        request->results.resize(request->batch.size());
+        for (size_t i = 0; i < request->batch.size(); i++) {
+          jobs.push_back(Job{request, i});
+        }
+      }
+      auto key = [](Job const& job) {
+        ContractBatch const& b = job.request->batch;
+        return std::make_tuple(b.precisions[job.index], b.seeded[job.index], b.seeds[job.index], b.contracts[job.index].num_sims);
+      };
+      stable_sort(jobs.begin(), jobs.end(), [&key](Job const& a, Job const& b) { return key(a) < key(b); });
+
+      vector<Contract> group;
+      vector<PricingResult> results;
+      for (size_t begin = 0, end; begin < jobs.size(); begin = end) {
+        for (end = begin + 1; end < jobs.size() && key(jobs[end]) == key(jobs[begin]); end++) {
+        }
+        group.clear();
+        for (size_t j = begin; j < end; j++) {
+          group.push_back(jobs[j].request->batch.contracts[jobs[j].index]);
+        }
+        ContractBatch const& first = jobs[begin].request->batch;
+        if (first.seeded[jobs[begin].index]) {
+          _engine.seed(first.seeds[jobs[begin].index]);
+        } else {
+          _engine.unseed();
+        }
+        results.resize(group.size());
+        price_shared(_engine, group.data(), group.size(), results.data(), first.precisions[jobs[begin].index]);
+        for (size_t j = begin; j < end; j++) {
+          jobs[j].request->results[jobs[j].index] = results[j - begin];
+        }
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        _path_sets++;
+      }
+    }
+
+  public:
+    PricingServer(EngineContext& engine, size_t max_batch, long window_us)
+      : _engine(engine), _max_batch(max_batch), _window(window_us) {}
+
+    // Queues a request and waits until it is priced. False, at once, if the server is
+    // stopping; requests queued before stop() are still priced.
+    bool submit(Request& request) {
+      std::unique_lock<std::mutex> lock(_mutex);
+      if (_stopping) {
+        return false;
+      }
+      request.enqueued = Clock::now();
+      _queue.push_back(&request);
+      _queued_contracts += request.batch.size();
+      _max_queue_depth = max(_max_queue_depth, _queued_contracts);
+      _queued.notify_one();
+      _priced.wait(lock, [&request] { return request.done; });
+      return true;
+    }
+
+    // The pricing loop; returns once stop() has been called and the queue is empty.
+    void run() {
+      vector<Request*> batch;
+      while (true) {
+        {
+          std::unique_lock<std::mutex> lock(_mutex);
+          _queued.wait(lock, [this] { return !_queue.empty() || _stopping; });
+          if (_queue.empty()) {
+            return;
+          }
+          // give concurrent requests the window to join the batch
+          Clock::time_point deadline = _queue.front()->enqueued + _window;
+          _queued.wait_until(lock, deadline, [this] { return _queued_contracts >= _max_batch || _stopping; });
+
+          batch.clear();
+          size_t contracts = 0;
+          while (!_queue.empty() && (batch.empty() || contracts + _queue.front()->batch.size() <= _max_batch)) {
+            contracts += _queue.front()->batch.size();
+            batch.push_back(_queue.front());
+            _queue.pop_front();
+          }
+          _queued_contracts -= contracts;
+
+          Clock::time_point now = Clock::now();
+          for (Request* request : batch) {
+            request->started = now;
+            _queue_wait.add(std::chrono::duration<double, std::micro>(now - request->enqueued).count());
+          }
+          _batches++;
+          _contracts += contracts;
+          _requests += batch.size();
+          _largest_batch = max(_largest_batch, contracts);
+          int bucket = 0;
+          while (bucket < 15 && (size_t(2) << bucket) <= contracts) {
+            bucket++;
+          }
+          _batch_sizes[bucket]++;
+        }
+
+        price_batch(batch);
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        Clock::time_point now = Clock::now();
+        for (Request* request : batch) {
+          _latency.add(std::chrono::duration<double, std::micro>(now - request->enqueued).count());
+          request->done = true;
+        }
+        _priced.notify_all();
+      }
+    }
+
+    void stop() {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stopping = true;
+      _queued.notify_all();
+    }
+
+    string stats_json(unsigned connections) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      double uptime = std::chrono::duration<double>(Clock::now() - _started).count();
+      ostringstream out;
+      out << "{\"uptimeSeconds\": " << json_number(uptime, 6) << ", \"connections\": " << connections
+          << ", \"threads\": " << _engine.pool.size() << ", \"isa\": \"" << isa_name(active_isa()) << "\""
+          << ", \"queueDepth\": {\"requests\": " << _queue.size() << ", \"contracts\": " << _queued_contracts
+          << ", \"maxContracts\": " << _max_queue_depth << "}"
+          << ", \"requests\": " << _requests << ", \"contracts\": " << _contracts << ", \"batches\": " << _batches
+          << ", \"pathSets\": " << _path_sets
+          << ", \"batchSize\": {\"mean\": " << json_number(_batches ? static_cast<double>(_contracts) / static_cast<double>(_batches) : 0.0, 6)
+          << ", \"max\": " << _largest_batch << ", \"histogram\": {";
+      bool first = true;
+      for (int b = 0; b < 16; b++) {
+        if (_batch_sizes[b]) {
+          out << (first ? "" : ", ") << "\"" << (size_t(1) << b) << "\": " << _batch_sizes[b];
+          first = false;
+        }
+      }
+      out << "}}, \"latencyUs\": " << _latency.percentiles_json() << ", \"queueWaitUs\": " << _queue_wait.percentiles_json() << "}";
+      return out.str();
+    }
+};
+
+static std::atomic<unsigned> open_connections{0};
+
+static void serve_connection(int fd, PricingServer& server) {
+  string payload;
+  while (read_frame(fd, payload)) {
+    size_t start = payload.find_first_not_of(" \t\r\n");
+    bool json = start != string::npos && payload[start] == '{';
+    Request request;
+    string error;
+    string response;
+    if (json) {
+      JsonRequest parsed;
+      if (!parse_json_request(payload.data(), payload.data() + payload.size(), request.batch, parsed)) {
+        response = json_error(parsed.error == JsonError::Precision ? "InvalidPrecision" : "InvalidJSON", parsed.message);
+      } else if (parsed.stats) {
+        response = server.stats_json(open_connections.load());
+      }
+    } else if (!parse_binary_request(payload, request, error)) {
+      response = binary_error(error);
+    }
+
+    if (response.empty()) {
+      if (request.batch.size() > 0 && !server.submit(request)) {
+        response = json ? json_error("ServerStopping", "the server is shutting down") : binary_error("the server is shutting down");
+      } else {
+        response = encode_response(request);
+      }
+    }
+    if (!write_frame(fd, response)) {
+      break;
+    }
+  }
+}
+
+// The connection threads. Each serves its socket until the client closes it; at shutdown
+// close_all() wakes those still blocked on a read and joins every one, so no connection
+// outlives the server it submits to.
+class Connections {
+  private:
+    struct Connection {
+      int fd;
+      bool finished = false;
+      std::thread thread;
+    };
+
+    std::mutex _mutex;
+    list<Connection> _connections;
+
+    // joins the threads whose connection has ended, under _mutex
+    void reap() {
+      for (auto it = _connections.begin(); it != _connections.end();) {
+        if (it->finished) {
+          it->thread.join();
+          it = _connections.erase(it);
+        } else {
+          ++it;
+        }
+      }
+    }
+
+  public:
+    void start(int fd, PricingServer& server) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      reap();
+      _connections.emplace_back();
+      Connection& connection = _connections.back();
+      connection.fd = fd;
+      open_connections++;
+      // the thread marks itself finished under _mutex, so not before it has been stored
+      connection.thread = std::thread([this, &connection, &server] {
+        serve_connection(connection.fd, server);
+        std::lock_guard<std::mutex> done(_mutex);
+        close(connection.fd);
+        connection.finished = true;
+        open_connections--;
+      });
+    }
+
+    void close_all() {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (Connection& connection : _connections) {
+          if (!connection.finished) {
+            shutdown(connection.fd, SHUT_RDWR);
+          }
+        }
+      }
+      // no new connections are started, so the list only changes in finished flags
+      for (Connection& connection : _connections) {
+        connection.thread.join();
+      }
+      std::lock_guard<std::mutex> lock(_mutex);
+      _connections.clear();
+    }
+};
+
+int main(int argc, char **argv) {
+  string socket_path = "/tmp/mcserver.sock";
+  unsigned threads = detect_available_cpus();
+  size_t max_batch = 256;
+  long window_us = 200;
+  unsigned max_connections = 256;
+
+  for (int i = 1; i < argc; i++) {
+    string value;
+    if (flag_value(argv[i], "--socket", value)) {
+      socket_path = value;
+    } else if (flag_value(argv[i], "--threads", value)) {
+      threads = static_cast<unsigned>(max(1, atoi(value.c_str())));
+    } else if (flag_value(argv[i], "--max_batch", value)) {
+      max_batch = static_cast<size_t>(max(1, atoi(value.c_str())));
+    } else if (flag_value(argv[i], "--batch_window_us", value)) {
+      window_us = max(0L, atol(value.c_str()));
+    } else if (flag_value(argv[i], "--max_connections", value)) {
+      max_connections = static_cast<unsigned>(max(1, atoi(value.c_str())));
+    } else if (flag_value(argv[i], "--isa", value)) {
+      Isa isa;
+      if (!isa_from_string(value, isa) || !set_isa(isa)) {
+        cerr << "Kernel level " << value << " is unknown or not supported by this CPU (sse2, avx2, avx512)\n";
+        return -1;
+      }
+    } else {
+      cerr << "Unknown argument " << argv[i] << "\n"
+           << "Usage: mcserver [--socket=<path>] [--threads=<n>] [--max_batch=<contracts>] [--batch_window_us=<us>] [--max_connections=<n>] [--isa=sse2|avx2|avx512]\n";
+      return -1;
+    }
+  }
+
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(address.sun_path)) {
+    cerr << "Socket path too long: " << socket_path << "\n";
+    return -1;
+  }
+  strcpy(address.sun_path, socket_path.c_str());
+
+  int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  unlink(socket_path.c_str());
+  if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 128) != 0) {
+    cerr << "Cannot listen on " << socket_path << ": " << strerror(errno) << "\n";
+    return -1;
+  }
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = on_signal;
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+
+  // METRICS=1 prints per-phase timings at shutdown
+  set_metrics_enabled(metrics_from_env());
+  Clock::time_point wall_start = Clock::now();
+
+  EngineContext engine(threads);
+  PricingServer server(engine, max_batch, window_us);
+  std::thread pricing([&server] { server.run(); });
+  Connections connections;
+
+  cerr << "Listening on " << socket_path << ": " << engine.pool.size() << " threads, kernels " << isa_name(active_isa())
+       << ", batches of up to " << max_batch << " contracts, " << window_us << " us window\n";
+
+  while (!stop_requested) {
+    pollfd waiting{listener, POLLIN, 0};
+    if (poll(&waiting, 1, 200) <= 0) {
+      continue;
+    }
+    int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0) {
+      continue;
+    }
+    if (open_connections.load() >= max_connections) {
+      close(fd);
+      continue;
+    }
+    connections.start(fd, server);
+  }
+
+  // new requests are refused from here, queued ones still priced while the connections end
+  close(listener);
+  unlink(socket_path.c_str());
+  server.stop();
+  connections.close_all();
+  pricing.join();
+  cerr << server.stats_json(open_connections.load()) << "\n";
+  if (metrics_enabled()) {
+    cerr << "METRICS (summed over threads):" << endl << metrics_summary(metrics_snapshot(), std::chrono::duration<double>(Clock::now() - wall_start).count());
+  }
+  return 0;
+}
@@ -0,0 +1,104 @@
+#!/usr/bin/env bash
+# Builds the release binaries and reports what LTO and PGO gain on the benchmark suite.
+#
+#   scripts/release_build.sh [out_dir] [-- <mcbench flags>]
+#
+# Four build trees under out_dir (default build-release):
+#   baseline  Release, as a plain `cmake -S . -B build` configures it
+#   lto       Release + MC_LTO
+#   pgo       Release + MC_PGO: instrumented build, `pgo-train` workload, rebuild with the
+#             profile
+#   pgo-lto   both. Its binaries (sim, mcbench, mcaccuracy, mcread and the Lambda target
+#             where the AWS SDK is found) are the release binaries.
+#
+# Each tree's mcbench then runs with the same flags (default: the whole suite up to 10^7
+# paths) and writes <tree>/mcbench.json; the report lists ns/item per benchmark and each
+# tree's speed-up over baseline, and is saved as out_dir/report.txt.
+
+set -euo pipefail
+
+src="$(cd "$(dirname "$0")/.." && pwd)"
+out="build-release"
+if [[ $# -gt 0 && "$1" != "--" ]]; then
+  out="$1"
+  shift
+fi
+[[ $# -gt 0 && "$1" == "--" ]] && shift
+bench_flags=("$@")
+if [[ ${#bench_flags[@]} -eq 0 ]]; then
+  bench_flags=(--benchmark_min_time=0.5 --max_paths=10000000)
+fi
+mkdir -p "$out"
+out="$(cd "$out" && pwd)"
+jobs="$(nproc 2>/dev/null || echo 2)"
+
+configure_and_build() {
+  local dir="$1"
+  shift
+  cmake -S "$src" -B "$dir" -DCMAKE_BUILD_TYPE=Release "$@" >/dev/null
+  cmake --build "$dir" -j"$jobs" >/dev/null
+}
+
+build_pgo() {
+  local dir="$1"
+  shift
+  configure_and_build "$dir" "$@" -DMC_PGO=GENERATE
+  cmake --build "$dir" --target pgo-train >/dev/null
+  configure_and_build "$dir" "$@" -DMC_PGO=USE
+}
+
+trees=(baseline lto pgo pgo-lto)
+
+echo "== baseline"
+configure_and_build "$out/baseline" -DMC_LTO=OFF -DMC_PGO=OFF
+echo "== lto"
+configure_and_build "$out/lto" -DMC_LTO=ON -DMC_PGO=OFF
+echo "== pgo: instrumented build, training run, rebuild with the profile"
+build_pgo "$out/pgo" -DMC_LTO=OFF
+echo "== pgo-lto: instrumented build, training run, rebuild with the profile"
+build_pgo "$out/pgo-lto" -DMC_LTO=ON
+
+jsons=()
+for tree in "${trees[@]}"; do
+  echo "== benchmarking $tree"
+  "$out/$tree/mcbench" "${bench_flags[@]}" --benchmark_out="$out/$tree/mcbench.json" >/dev/null
+  jsons+=("$out/$tree/mcbench.json")
+done
+
+# mcbench writes one benchmark per line: pick out name and ns_per_item
+awk -v names="${trees[*]}" '
+  BEGIN { trees = split(names, tree_name, " ") }
+  FNR == 1 { tree++ }
+  match($0, /"name": "[^"]*"/) {
+    name = substr($0, RSTART + 9, RLENGTH - 10)
+    if (!match($0, /"ns_per_item": [^,}]*/)) next
+    ns[name, tree] = substr($0, RSTART + 15, RLENGTH - 15) + 0
+    if (tree == 1) order[++count] = name
+  }
+  END {
+    printf "%-44s", "benchmark (ns/item)"
+    for (t = 1; t <= trees; t++) printf " %10s", tree_name[t]
+    for (t = 2; t <= trees; t++) printf " %9s", tree_name[t]
+    printf "\n"
+    for (i = 1; i <= count; i++) {
+      n = order[i]
+      complete = 1
+      for (t = 1; t <= trees; t++) if (ns[n, t] <= 0) complete = 0
+      if (!complete) continue
+      printf "%-44s", n
+      for (t = 1; t <= trees; t++) printf " %10.3f", ns[n, t]
+      for (t = 2; t <= trees; t++) {
+        printf " %8.2fx", ns[n, 1] / ns[n, t]
+        log_speedup[t] += log(ns[n, 1] / ns[n, t])
+      }
+      printf "\n"
+      rows++
+    }
+    if (rows > 0) {
+      printf "%-44s", "geometric mean speed-up"
+      for (t = 1; t <= trees; t++) printf " %10s", ""
+      for (t = 2; t <= trees; t++) printf " %8.2fx", exp(log_speedup[t] / rows)
+      printf "\n"
+    }
+  }
+' "${jsons[@]}" | tee "$out/report.txt"
@@ -1,85 +1,148 @@
+// Sim CLI: prices European calls and puts with the Monte Carlo engine.
+//
+//   sim [--paths=<n>] [--spot=<S>] [--strike=<K>] [--rate=<r>] [--vol=<v>] [--maturity=<T>]
+//       [--file=<path>|-] [--throughput] [--batch=<n>] [--out=<path>|-] [--to-binary=<path>]
+//       [--threads=<n>] [--seed=<n>] [--affinity] [--huge_pages=off|thp|hugetlb]
+//       [--precision=double|float|float-kahan] [--isa=sse2|avx2|avx512] [--format=text|csv]
+//   sim <num_of_montecarlo_paths_per_thread> <num_threads> <thread_affinity(0/1)> [precision]
+//
+// The contract flags price a single contract (by default 10^6 paths, S=K=100, r=5%, v=20%,
+// T=1). --file reads contracts from a CSV or binary contract file (engine/contract_input.h),
+// memory-mapped, or CSV from stdin for "-". Each contract has its paths split over all
+// threads, or with --throughput every thread prices whole contracts, which is what a
+// stream of small contracts wants. Contracts are read and priced --batch at a time and
+// each batch written in input order, as text or as CSV (the default for --file): the
+// engine/result_format.h columns and both standard errors. With --seed every contract
+// starts from the same streams, so it prices the same wherever it is in the input, on any
+// number of threads and in either mode, and as the Lambda function and mcserver price it.
+//
+// --affinity pins the workers to CPUs, round robin as the demo does, and on a multi-node
+// machine keeps each worker's buffers on its own NUMA node. --huge_pages picks how those
+// buffers are backed (engine/arena.h; MC_HUGE_PAGES does the same). The summary reports
+// the page faults, CPU and NUMA page migrations and huge page use of the run.
+//
+// --out is for books too big to batch: the file is split over the workers by byte range
+// and rows are appended to the output as they complete, each led by its record number, so
+// `sort -t, -n` restores input order. --to-binary converts the input to the binary format.
+//
+// The positional form is the original threading demo: every thread prices its own
+// contract, S=100+thread, optionally pinned to a CPU.
+
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
 #include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <sstream>
+#include <string>
 #include <thread>
+#include <unistd.h>
 #include <vector>
 #include <random>
 
-using namespace std;
-
-class MonteCarloSimThread {
-  private:
-    std::random_device rd;
-    std::mt19937 gen{rd()};
-    std::normal_distribution<double> distribution{0.0, 1.0};
+#include "engine/contract_input.h"
+#include "engine/mc_engine.h"
+#include "engine/result_format.h"
 
-    double gaussian_rnd() {
-      return distribution(gen);
-    }
-
-    // Pricing a European vanilla call option with a Monte Carlo method
-    double monte_carlo_call_price(const int& num_sims, const double& S, const double& K, const double& r, const double& v, const double& T) {
-      double S_adjust = S * exp(T*(r-0.5*v*v));
-      double S_cur = 0.0;
-      double payoff_sum = 0.0;
-
-      for (int i=0; i<num_sims; i++) {
-        double gauss_bm = gaussian_rnd();
-        S_cur = S_adjust * exp(sqrt(v*v*T)*gauss_bm);
-        payoff_sum += std::max(S_cur - K, 0.0);
-        //printThread(i);
-      }
+using namespace std;
 
-      return (payoff_sum / static_cast<double>(num_sims)) * exp(-r*T);
+static void print_perf(ostream& out, mc::PerfSample const& sample) {
+  for (int e = 0; e < mc::PERF_EVENT_COUNT; e++) {
+    string name = string(mc::perf_event_name(e)) + ":";
+    name.resize(16, ' ');
+    out << " " << name;
+    if (sample.valid[e]) {
+      out << sample.values[e] << endl;
+    } else {
+      out << "n/a" << endl;
     }
+  }
+  if (sample.ipc() > 0.0) {
+    out << " IPC:            " << sample.ipc() << endl;
+  }
+}
 
-    // Pricing a European vanilla put option with a Monte Carlo method
-    double monte_carlo_put_price(const int& num_sims, const double& S, const double& K, const double& r, const double& v, const double& T) {
-      double S_adjust = S * exp(T*(r-0.5*v*v));
-      double S_cur = 0.0;
-      double payoff_sum = 0.0;
-
-      for (int i=0; i<num_sims; i++) {
-        double gauss_bm = gaussian_rnd();
-        S_cur = S_adjust * exp(sqrt(v*v*T)*gauss_bm);
-        payoff_sum += std::max(K - S_cur, 0.0);
-        //printThread(i);
-      }
+static void print_contract(ostream& out, mc::PricingResult const& result) {
+  out << " Number of Paths: " << result.num_sims << endl;
+  out << " Underlying:      " << result.S << endl;
+  out << " Strike:          " << result.K << endl;
+  out << " Risk-Free Rate:  " << result.r << endl;
+  out << " Volatility:      " << result.v << endl;
+  out << " Maturity:        " << result.T << endl;
 
-      return (payoff_sum / static_cast<double>(num_sims)) * exp(-r*T);
-    }
+  out << " Call Price:      " << result.call << endl;
+  out << " Put Price:       " << result.put << endl;
+}
 
-    void printThread(int i) {
-      if (i % 1000000 == 0) {
-        cout << "Thread #" << std::this_thread::get_id() << ": on CPU " << sched_getcpu() << "\n";
-      }
-    }
+class MonteCarloSimThread {
+  private:
+    mc::WorkerState state{std::random_device{}()};
+    unique_ptr<mc::PerfCounters> counters;
 
   public:
+    bool count_perf = false;
+    mc::Precision precision = mc::Precision::Double;
+    mc::PerfSample perf;
+
     MonteCarloSimThread() {}
 
     void run(const int& num_sims, const double& S, const double& K, const double& r, const double& v, const double& T) {
 
+      // hardware counters around the pricing only, when PERF_COUNTERS=1; opened once, so
+      // after the first run pricing allocates nothing
+      if (count_perf && !counters) {
+        counters.reset(new mc::PerfCounters());
+      }
+      if (counters) {
+        counters->start();
+      }
+
       // calculate the call/put values via Monte Carlo
-      double call = monte_carlo_call_price(num_sims, S, K, r, v, T);
-      double put = monte_carlo_put_price(num_sims, S, K, r, v, T);
+      mc::PricingResult result = mc::price_serial(state, mc::Contract{num_sims, S, K, r, v, T}, precision);
 
-      cout << "THREAD:           " << this_thread::get_id() << endl;
-      cout << " Number of Paths: " << num_sims << endl;
-      cout << " Underlying:      " << S << endl;
-      cout << " Strike:          " << K << endl;
-      cout << " Risk-Free Rate:  " << r << endl;
-      cout << " Volatility:      " << v << endl;
-      cout << " Maturity:        " << T << endl;
+      if (counters) {
+        perf = counters->stop();
+      }
 
-      cout << " Call Price:      " << call << endl;
-      cout << " Put Price:       " << put << endl << endl;
+      mc::ScopedTimer timer(mc::PHASE_SERIALISE, 1);
+      cout << "THREAD:           " << this_thread::get_id() << endl;
+      print_contract(cout, result);
+      if (perf.any()) {
+        print_perf(cout, perf);
+      }
+      cout << endl;
     }
 };
 
-int main(int argc, char **argv) {
+static void print_metrics(ostream& out, std::chrono::steady_clock::time_point wall_start) {
+  double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+  mc::MetricsSnapshot totals = mc::metrics_snapshot();
+  out << "METRICS (summed over threads):" << endl << mc::metrics_summary(totals, wall);
+  if (!mc::export_metrics_files(totals, totals, wall)) {
+    std::cerr << "Cannot write METRICS_JSON/METRICS_PROM file\n";
+  }
+}
+
+// sim <paths_per_thread> <threads> <affinity> [precision]
+static int run_demo(int argc, char **argv) {
   if (argc < 4) {
-    std::cout << "Need 3 arguments: sim <num_of_montecarlo_paths_per_thread(int)> <num_threads(int)> <thread_affinity(0/1)>\n";
+    std::cout << "Need 3 arguments: sim <num_of_montecarlo_paths_per_thread(int)> <num_threads(int)> <thread_affinity(0/1)> [double|float|float-kahan]\n";
+    return -1;
+  }
+
+  //optional 4th argument: path precision
+  mc::Precision precision = mc::Precision::Double;
+  if (argc > 4 && !mc::precision_from_string(argv[4], precision)) {
+    std::cout << "Unknown precision " << argv[4] << ", expected double, float or float-kahan\n";
     return -1;
   }
 
@@ -89,6 +152,10 @@ int main(int argc, char **argv) {
 
   int num_cpus = std::thread::hardware_concurrency();
 
+  // METRICS=1 prints per-phase timings at the end
+  mc::set_metrics_enabled(mc::metrics_from_env());
+  auto wall_start = std::chrono::steady_clock::now();
+
   //parameter list for montecarlo option pricing
   constexpr double _S = 100.0;  // Option price
   constexpr double _K = 100.0;  // Strike price
@@ -102,10 +169,14 @@ int main(int argc, char **argv) {
   cpu_set_t cpuset;
 
   cout << "Found " << num_cpus << " CPUs\n";
+  // MC_ISA=sse2|avx2|avx512 forces a lower kernel level
+  cout << "Kernels: " << mc::isa_name(mc::active_isa()) << " (detected " << mc::isa_name(mc::detect_isa()) << ")\n";
 
   //create threads and set affinity
-  for (unsigned t=0; t < num_threads; t++) {
+  for (int t=0; t < num_threads; t++) {
 		auto &simThread = vecOfObj[t];
+    simThread.count_perf = mc::perf_counters_from_env();
+    simThread.precision = precision;
 
     vecOfThreads.push_back(std::thread(&MonteCarloSimThread::run, &simThread, num_sims, _S+t, _K, _r, _v, _T));
     cout << "Started thread " << t << endl;
@@ -125,5 +196,564 @@ int main(int argc, char **argv) {
 		thread.join();
   }
 
+  //counters summed over all threads
+  mc::PerfSample total;
+  for (auto &simThread : vecOfObj) {
+    total += simThread.perf;
+  }
+  if (total.any()) {
+    cout << "ALL THREADS:" << endl;
+    print_perf(cout, total);
+  } else if (mc::perf_counters_from_env()) {
+    cout << "Hardware performance counters unavailable" << endl;
+  }
+
+  if (mc::metrics_enabled()) {
+    print_metrics(cout, wall_start);
+  }
+
+  return 0;
+}
+
+// Page faults and migrations since start, and where the worker buffers ended up.
+static void print_memory(ostream& out, mc::EngineContext const& engine, mc::MemoryStats const& start) {
+  mc::MemoryStats end = mc::memory_stats();
+  size_t arena_bytes = engine.scratch.capacity();
+  size_t hugetlb_bytes = engine.scratch.hugetlb_bytes();
+  for (mc::WorkerState const& worker : engine.workers) {
+    arena_bytes += worker.arena.capacity();
+    hugetlb_bytes += worker.arena.hugetlb_bytes();
+  }
+  out << "Page faults: " << end.minor_faults - start.minor_faults << " minor, " << end.major_faults - start.major_faults
+      << " major; NUMA pages migrated: " << end.numa_pages_migrated - start.numa_pages_migrated << "\n";
+  out << "Arenas: " << arena_bytes / 1024 << " kB mapped, " << hugetlb_bytes / 1024 << " kB on hugetlbfs; "
+      << end.anon_huge_bytes / 1024 << " kB of the process on transparent huge pages\n";
+}
+
+static const char* USAGE =
+  "Usage: sim [--paths=<n>] [--spot=<S>] [--strike=<K>] [--rate=<r>] [--vol=<v>] [--maturity=<T>]\n"
+  "           [--file=<path>|-] [--throughput] [--batch=<n>] [--out=<path>|-] [--to-binary=<path>]\n"
+  "           [--threads=<n>] [--seed=<n>] [--affinity] [--huge_pages=off|thp|hugetlb]\n"
+  "           [--precision=double|float|float-kahan] [--isa=sse2|avx2|avx512] [--format=text|csv]\n"
+  "       sim <num_of_montecarlo_paths_per_thread> <num_threads> <thread_affinity(0/1)> [double|float|float-kahan]\n";
+
+static bool flag_value(const char* arg, const char* name, string& value) {
+  size_t n = strlen(name);
+  if (strncmp(arg, name, n) == 0 && arg[n] == '=') {
+    value = arg + n + 1;
+    return true;
+  }
+  return false;
+}
+
+// whole string is a number
+static bool parse_number(string const& text, double& value) {
+  char* end = nullptr;
+  value = strtod(text.c_str(), &end);
+  return !text.empty() && *end == '\0' && std::isfinite(value);
+}
+
+// Contracts in input order, from a mapped contract file or from stdin.
+class ContractReader {
+  private:
+    mc::ContractFile const* _file;
+    mc::ContractCursor _cursor;
+    istream* _in;
+    long _line_number = 0;
+    string _line;
+
+  public:
+    explicit ContractReader(mc::ContractFile const& file) : _file(&file), _cursor(file.all()), _in(nullptr) {}
+    explicit ContractReader(istream& in) : _file(nullptr), _cursor(nullptr, nullptr, false), _in(&in) {}
+
+    // The next contract; false at the end of the input, or at a malformed line with the
+    // reason in error.
+    bool next(mc::Contract& contract, string& error) {
+      if (_file) {
+        if (_cursor.next(contract)) {
+          return true;
+        }
+        if (!_cursor.at_end()) {
+          error = _file->location(_cursor.position()) + ": expected num_paths,S,K,r,v,T";
+        }
+        return false;
+      }
+
+      while (getline(*_in, _line)) {
+        _line_number++;
+        const char* begin = _line.data();
+        const char* end = begin + _line.size();
+        switch (mc::parse_contract_line(begin, end, contract)) {
+          case mc::ContractLine::Contract:
+            return true;
+          case mc::ContractLine::Blank:
+            break;
+          case mc::ContractLine::Invalid:
+            if (_line_number == 1 && mc::is_header_line(begin, end)) {
+              break;
+            }
+            error = "line " + to_string(_line_number) + ": expected num_paths,S,K,r,v,T, got \"" + _line + "\"";
+            return false;
+        }
+      }
+      return false;
+    }
+
+    // Reads up to batch_size contracts; false on a malformed line.
+    bool read_batch(size_t batch_size, vector<mc::Contract>& batch, string& error) {
+      batch.clear();
+      mc::Contract contract;
+      while (batch.size() < batch_size && next(contract, error)) {
+        batch.push_back(contract);
+      }
+      return error.empty();
+    }
+};
+
+// Runs job(worker) on every pool worker, with its hardware counters around it as price()
+// does when they are enabled.
+static void run_counted(mc::EngineContext& engine, std::function<void(unsigned)> const& job) {
+  engine.pool.run([&](unsigned w) {
+    mc::PerfCounters* counters = nullptr;
+    if (engine.perf_enabled) {
+      if (!engine.perf_counters[w]) {
+        engine.perf_counters[w].reset(new mc::PerfCounters());
+      }
+      counters = engine.perf_counters[w].get();
+      counters->start();
+    }
+
+    job(w);
+
+    if (counters) {
+      engine.perf[w] = counters->stop();
+    }
+  });
+}
+
+struct BatchOptions {
+  bool throughput = false;
+  bool seeded = false;
+  unsigned long long seed = 0;
+  mc::Precision precision = mc::Precision::Double;
+};
+
+// Throughput mode: the workers take whole contracts off a shared index.
+static void price_batch_throughput(mc::EngineContext& engine, vector<mc::Contract> const& batch, BatchOptions const& options, vector<mc::PricingResult>& results) {
+  std::atomic<size_t> next{0};
+  run_counted(engine, [&](unsigned w) {
+    mc::WorkerState& state = engine.workers[w];
+    for (size_t i = next.fetch_add(1, std::memory_order_relaxed); i < batch.size(); i = next.fetch_add(1, std::memory_order_relaxed)) {
+      if (options.seeded) {
+        state.seed(options.seed, 0);
+      }
+      results[i] = mc::price_serial(state, batch[i], options.precision);
+    }
+  });
+}
+
+static void price_batch(mc::EngineContext& engine, vector<mc::Contract> const& batch, BatchOptions const& options, vector<mc::PricingResult>& results, mc::PerfSample& perf) {
+  results.resize(batch.size());
+  if (options.throughput) {
+    price_batch_throughput(engine, batch, options, results);
+    perf += engine.perf_total();
+    return;
+  }
+  for (size_t i = 0; i < batch.size(); i++) {
+    if (options.seeded) {
+      engine.seed(options.seed);
+    }
+    results[i] = mc::price(engine, batch[i], options.precision);
+    perf += engine.perf_total();
+  }
+}
+
+static void write_csv_header(ostream& out) {
+  for (size_t c = 0; c < mc::RESULT_COLUMN_COUNT; c++) {
+    out << (c ? "," : "") << mc::RESULT_COLUMNS[c].name;
+  }
+  out << ",call_stderr,put_stderr\n";
+}
+
+static void write_results(ostream& out, vector<mc::PricingResult> const& results, bool csv) {
+  mc::ScopedTimer timer(mc::PHASE_SERIALISE, static_cast<long>(results.size()));
+  for (mc::PricingResult const& r : results) {
+    if (csv) {
+      out << r.num_sims << "," << r.S << "," << r.K << "," << r.r << "," << r.v << "," << r.T << ","
+          << r.call << "," << r.put << "," << r.call_stderr << "," << r.put_stderr << "\n";
+    } else {
+      print_contract(out, r);
+      out << " Call Std. Error: " << r.call_stderr << endl;
+      out << " Put Std. Error:  " << r.put_stderr << endl << endl;
+    }
+  }
+  out.flush();
+}
+
+static bool write_all(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t n = write(fd, data, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    size -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+// parts of the book per worker, so workers that get slow contracts do not hold up the rest
+static const unsigned PARTS_PER_WORKER = 8;
+// rows a worker formats before appending them to the output
+static const size_t OUTPUT_BLOCK_SIZE = 64 * 1024;
+static const size_t MAX_ROW_SIZE = 512;
+
+// Book mode (--out): prices a mapped contract file with its parts spread over the workers.
+// A counting pass gives each part the record number of its first contract; then every
+// worker takes parts off a shared index, prices their contracts one at a time, formats
+// the rows into its own buffer and appends the buffer to the output whenever it fills.
+// Results stream out as contracts complete, a block at a time, with the record number of
+// each contract in front of its row.
+static bool price_book(mc::EngineContext& engine, mc::ContractFile const& file, int out_fd, BatchOptions const& options, long& contracts, double& paths, string& error) {
+  unsigned parts = engine.pool.size() * PARTS_PER_WORKER;
+  vector<size_t> first_record(parts + 1, 0);
+  std::atomic<unsigned> next{0};
+  engine.pool.run([&](unsigned) {
+    for (unsigned p = next.fetch_add(1); p < parts; p = next.fetch_add(1)) {
+      first_record[p + 1] = file.part(p, parts).count();
+    }
+  });
+  std::partial_sum(first_record.begin(), first_record.end(), first_record.begin());
+
+  ostringstream header;
+  header << "record,";
+  write_csv_header(header);
+  if (!write_all(out_fd, header.str().data(), header.str().size())) {
+    error = string("cannot write the output: ") + strerror(errno);
+    return false;
+  }
+
+  std::mutex output_mutex;
+  std::atomic<bool> failed{false};
+  vector<long> worker_contracts(engine.pool.size(), 0);
+  vector<double> worker_paths(engine.pool.size(), 0.0);
+  next.store(0);
+  run_counted(engine, [&](unsigned w) {
+    mc::WorkerState& state = engine.workers[w];
+    vector<char> block(OUTPUT_BLOCK_SIZE + MAX_ROW_SIZE);
+    size_t used = 0;
+
+    auto fail = [&](string const& reason) {
+      std::lock_guard<std::mutex> lock(output_mutex);
+      if (!failed.exchange(true)) {
+        error = reason;
+      }
+    };
+    auto flush = [&]() {
+      std::lock_guard<std::mutex> lock(output_mutex);
+      if (!write_all(out_fd, block.data(), used) && !failed.exchange(true)) {
+        error = string("cannot write the output: ") + strerror(errno);
+      }
+      used = 0;
+    };
+
+    for (unsigned p = next.fetch_add(1); p < parts && !failed.load(std::memory_order_relaxed); p = next.fetch_add(1)) {
+      mc::ContractCursor cursor = file.part(p, parts);
+      size_t record = first_record[p];
+      mc::Contract c;
+      while (!failed.load(std::memory_order_relaxed) && cursor.next(c)) {
+        if (options.seeded) {
+          state.seed(options.seed, 0);
+        }
+        mc::PricingResult r = mc::price_serial(state, c, options.precision);
+
+        {
+          mc::ScopedTimer timer(mc::PHASE_SERIALISE, 1);
+          int n = snprintf(block.data() + used, MAX_ROW_SIZE, "%zu,%d,%.10g,%.10g,%.10g,%.10g,%.10g,%.10g,%.10g,%.10g,%.10g\n",
+                           record++, r.num_sims, r.S, r.K, r.r, r.v, r.T, r.call, r.put, r.call_stderr, r.put_stderr);
+          used += static_cast<size_t>(min(max(n, 0), static_cast<int>(MAX_ROW_SIZE) - 1));
+        }
+        if (used >= OUTPUT_BLOCK_SIZE) {
+          flush();
+        }
+        worker_contracts[w]++;
+        worker_paths[w] += c.num_sims;
+      }
+      if (!cursor.at_end()) {
+        fail(file.location(cursor.position()) + ": expected num_paths,S,K,r,v,T");
+      }
+    }
+    if (used > 0) {
+      flush();
+    }
+  });
+
+  contracts = std::accumulate(worker_contracts.begin(), worker_contracts.end(), 0L);
+  paths = std::accumulate(worker_paths.begin(), worker_paths.end(), 0.0);
+  return !failed;
+}
+
+// --to-binary: the input as a binary contract file. The record count in the header is
+// filled in at the end, so the output must be a regular file.
+static bool write_binary(ContractReader& reader, string const& path, long& contracts, string& error) {
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    error = "cannot open " + path + ": " + strerror(errno);
+    return false;
+  }
+  vector<char> block(OUTPUT_BLOCK_SIZE);
+  size_t used = 0;
+  string header = mc::contract_file_header(0);
+  bool ok = write_all(fd, header.data(), header.size());
+
+  mc::Contract c;
+  contracts = 0;
+  while (ok && reader.next(c, error)) {
+    mc::encode_contract(c, block.data() + used);
+    used += mc::CONTRACT_RECORD_SIZE;
+    contracts++;
+    if (used + mc::CONTRACT_RECORD_SIZE > block.size()) {
+      ok = write_all(fd, block.data(), used);
+      used = 0;
+    }
+  }
+  if (!error.empty()) {
+    close(fd);
+    return false;
+  }
+  header = mc::contract_file_header(static_cast<uint64_t>(contracts));
+  ok = ok && write_all(fd, block.data(), used) && pwrite(fd, header.data(), header.size(), 0) == static_cast<ssize_t>(header.size());
+  if (close(fd) != 0 || !ok) {
+    error = "cannot write " + path + ": " + strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  // a number first: the original positional demo
+  if (argc > 1 && argv[1][0] != '-') {
+    return run_demo(argc, argv);
+  }
+
+  mc::Contract contract{1000000, 100.0, 100.0, 0.05, 0.2, 1.0};
+  bool contract_flags = false;
+  string input_path;
+  string out_path;
+  string binary_path;
+  string format;
+  size_t batch_size = 4096;
+  unsigned threads = mc::detect_available_cpus();
+  bool affinity = false;
+  BatchOptions options;
+
+  for (int i = 1; i < argc; i++) {
+    string value;
+    double number = 0.0;
+    double* contract_field = nullptr;
+    if (flag_value(argv[i], "--paths", value)) {
+      if (!parse_number(value, number) || number < 1 || number > 2147483647.0) {
+        cerr << "--paths must be between 1 and 2^31-1\n";
+        return -1;
+      }
+      contract.num_sims = static_cast<int>(number);
+      contract_flags = true;
+    } else if (flag_value(argv[i], "--spot", value)) {
+      contract_field = &contract.S;
+    } else if (flag_value(argv[i], "--strike", value)) {
+      contract_field = &contract.K;
+    } else if (flag_value(argv[i], "--rate", value)) {
+      contract_field = &contract.r;
+    } else if (flag_value(argv[i], "--vol", value)) {
+      contract_field = &contract.v;
+    } else if (flag_value(argv[i], "--maturity", value)) {
+      contract_field = &contract.T;
+    } else if (flag_value(argv[i], "--file", value)) {
+      input_path = value;
+    } else if (flag_value(argv[i], "--out", value)) {
+      out_path = value;
+    } else if (flag_value(argv[i], "--to-binary", value)) {
+      binary_path = value;
+    } else if (strcmp(argv[i], "--throughput") == 0) {
+      options.throughput = true;
+    } else if (flag_value(argv[i], "--batch", value)) {
+      batch_size = static_cast<size_t>(max(1, atoi(value.c_str())));
+    } else if (flag_value(argv[i], "--threads", value)) {
+      threads = static_cast<unsigned>(max(1, atoi(value.c_str())));
+    } else if (flag_value(argv[i], "--seed", value)) {
+      options.seeded = true;
+      options.seed = strtoull(value.c_str(), nullptr, 10);
+    } else if (flag_value(argv[i], "--precision", value)) {
+      if (!mc::precision_from_string(value, options.precision)) {
+        cerr << "Unknown precision " << value << ", expected double, float or float-kahan\n";
+        return -1;
+      }
+    } else if (flag_value(argv[i], "--isa", value)) {
+      mc::Isa isa;
+      if (!mc::isa_from_string(value, isa) || !mc::set_isa(isa)) {
+        cerr << "Kernel level " << value << " is unknown or not supported by this CPU (sse2, avx2, avx512)\n";
+        return -1;
+      }
+    } else if (strcmp(argv[i], "--affinity") == 0) {
+      affinity = true;
+    } else if (flag_value(argv[i], "--huge_pages", value)) {
+      mc::HugePages mode;
+      if (!mc::huge_pages_from_string(value, mode)) {
+        cerr << "Unknown huge page mode " << value << ", expected off, thp or hugetlb\n";
+        return -1;
+      }
+      mc::set_huge_pages(mode);
+    } else if (flag_value(argv[i], "--format", value) && (value == "text" || value == "csv")) {
+      format = value;
+    } else if (strcmp(argv[i], "--help") == 0) {
+      cout << USAGE;
+      return 0;
+    } else {
+      cerr << "Unknown argument " << argv[i] << "\n" << USAGE;
+      return -1;
+    }
+
+    if (contract_field) {
+      if (!parse_number(value, *contract_field)) {
+        cerr << "Not a number: " << argv[i] << "\n";
+        return -1;
+      }
+      contract_flags = true;
+    }
+  }
+  if (contract_flags && !input_path.empty()) {
+    cerr << "Give either contract flags or --file, not both\n" << USAGE;
+    return -1;
+  }
+  if (!out_path.empty() && (input_path.empty() || input_path == "-" || format == "text")) {
+    cerr << "--out takes a --file that can be mapped, and writes CSV\n" << USAGE;
+    return -1;
+  }
+  if (!binary_path.empty() && input_path.empty()) {
+    cerr << "--to-binary converts a --file\n" << USAGE;
+    return -1;
+  }
+  bool csv = format.empty() ? !input_path.empty() : format == "csv";
+
+  string error;
+  mc::ContractFile file;
+  unique_ptr<ContractReader> reader;
+  if (input_path == "-") {
+    reader.reset(new ContractReader(cin));
+  } else if (!input_path.empty()) {
+    if (!file.open(input_path, error)) {
+      cerr << error << "\n";
+      return -1;
+    }
+    reader.reset(new ContractReader(file));
+  }
+
+  if (!binary_path.empty()) {
+    long written = 0;
+    if (!write_binary(*reader, binary_path, written, error)) {
+      cerr << error << "\n";
+      return -1;
+    }
+    cerr << "Wrote " << written << " contracts to " << binary_path << "\n";
+    return 0;
+  }
+
+  // METRICS=1 prints per-phase timings at the end
+  mc::set_metrics_enabled(mc::metrics_from_env());
+  auto wall_start = std::chrono::steady_clock::now();
+  mc::MemoryStats memory_start = mc::memory_stats();
+
+  mc::EngineContext engine(threads);
+  if (affinity && !engine.pin_workers()) {
+    cerr << "Cannot pin the workers to CPUs, leaving them to the scheduler\n";
+  }
+  if (mc::perf_counters_from_env()) {
+    engine.enable_perf_counters();
+  }
+
+  // the run summary goes to stderr, so stdout is only results
+  options.throughput = options.throughput || !out_path.empty();
+  cerr << "Threads: " << engine.pool.size() << (options.throughput ? ", one contract each" : ", paths split") << "\n";
+  cerr << "Kernels: " << mc::isa_name(mc::active_isa()) << " (detected " << mc::isa_name(mc::detect_isa()) << ")\n";
+  cerr << "Memory: huge pages " << mc::huge_pages_name(mc::huge_pages()) << ", " << mc::numa_node_count() << " NUMA node(s)";
+  if (engine.pool.worker_cpu(0) >= 0) {
+    cerr << ", workers on CPUs";
+    for (unsigned w = 0; w < engine.pool.size(); w++) {
+      int cpu = engine.pool.worker_cpu(w);
+      cerr << " " << cpu << "/node" << max(0, mc::cpu_numa_node(cpu));
+    }
+  }
+  cerr << "\n";
+
+  mc::PerfSample perf;
+  long contracts = 0;
+  double paths = 0.0;
+  if (!out_path.empty()) {
+    int out_fd = out_path == "-" ? STDOUT_FILENO : open(out_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+      cerr << "Cannot open " << out_path << ": " << strerror(errno) << "\n";
+      return -1;
+    }
+    bool ok = price_book(engine, file, out_fd, options, contracts, paths, error);
+    perf += engine.perf_total();
+    if (out_fd != STDOUT_FILENO && close(out_fd) != 0 && ok) {
+      error = "cannot write " + out_path + ": " + strerror(errno);
+      ok = false;
+    }
+    if (!ok) {
+      cerr << error << "\n";
+      return -1;
+    }
+  }
+
+  if (csv && out_path.empty()) {
+    cout.precision(10);
+    write_csv_header(cout);
+  }
+
+  vector<mc::Contract> batch;
+  vector<mc::PricingResult> results;
+  while (out_path.empty()) {
+    if (reader) {
+      if (!reader->read_batch(batch_size, batch, error)) {
+        cerr << error << "\n";
+        return -1;
+      }
+    } else {
+      batch.assign(contracts == 0 ? 1 : 0, contract);
+    }
+    if (batch.empty()) {
+      break;
+    }
+
+    price_batch(engine, batch, options, results, perf);
+    write_results(cout, results, csv);
+
+    contracts += static_cast<long>(batch.size());
+    for (mc::Contract const& c : batch) {
+      paths += c.num_sims;
+    }
+  }
+
+  double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+  cerr << "Priced " << contracts << " contracts, " << paths << " paths in " << wall << " s: "
+       << (wall > 0.0 ? static_cast<double>(contracts) / wall : 0.0) << " contracts/s, " << (wall > 0.0 ? paths / wall : 0.0) << " paths/s\n";
+
+  print_memory(cerr, engine, memory_start);
+
+  if (perf.any()) {
+    cerr << "ALL THREADS:" << endl;
+    print_perf(cerr, perf);
+  } else if (mc::perf_counters_from_env()) {
+    cerr << "Hardware performance counters unavailable" << endl;
+  }
+
+  if (mc::metrics_enabled()) {
+    print_metrics(cerr, wall_start);
+  }
+
   return 0;
 }